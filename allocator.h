@@ -0,0 +1,33 @@
+/*
+ * allocator.h - The ABI of allocators that mdriver -A loads with dlopen
+ *
+ * A shared object exports ALLOCATOR_ENTRY, a function returning a
+ * pointer to its allocator_t. mdriver refuses one whose abi_version
+ * is not ALLOCATOR_ABI_VERSION. Every entry is required; an allocator
+ * without a real calloc or realloc builds them from the others.
+ */
+#include <stddef.h>
+
+#define ALLOCATOR_ABI_VERSION 1
+#define ALLOCATOR_ENTRY "allocator_entry"
+
+typedef struct {
+    size_t heap_bytes;      /* memory currently held from the system */
+    size_t allocated_bytes; /* bytes in allocated blocks, 0 if unknown */
+} allocator_stats_t;
+
+typedef struct {
+    int abi_version;                         /* ALLOCATOR_ABI_VERSION */
+    const char *name;                        /* column heading */
+    int (*init)(void);                       /* start an empty heap, < 0 on error */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    size_t (*usable_size)(void *ptr);        /* payload bytes of an allocated block */
+    void (*stats)(allocator_stats_t *stats);
+} allocator_t;
+
+typedef const allocator_t *(*allocator_entry_t)(void);
+
+#define ALLOCATOR_EXPORT __attribute__((visibility("default")))
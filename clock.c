@@ -1,6 +1,6 @@
 /* 
- * clock.c - Routines for using the cycle counters on x86, 
- *           Alpha, and Sparc boxes.
+ * clock.c - Routines for using the cycle counter on x86, with a
+ *           nanosecond clock standing in for it everywhere else.
  * 
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
@@ -10,157 +10,115 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/times.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include "clock.h"
 
+#define CAL_NSECS 10000000 /* how long to compare the TSC against the clock */
+
+int clock_tsc = 0;               /* clock_*_ticks read the TSC */
+static double ticks_per_ns = 1;  /* 1 for the clock_gettime fallback */
+static int clock_ready = 0;
+
 
 /******************************************************* 
- * Machine dependent functions 
+ * Nanosecond timer
  *
- * Note: the constants __i386__ and  __alpha
- * are set by GCC when it calls the C preprocessor
- * You can verify this for yourself using gcc -v.
+ * On x86, the TSC ticks at a constant rate across frequency and
+ * sleep states when CPUID reports it invariant, so it can be used as
+ * a clock once its rate is known. We also require rdtscp, which the
+ * end of an interval needs. Everywhere else, or when either is
+ * missing, a tick is a nanosecond of CLOCK_MONOTONIC_RAW.
  *******************************************************/
 
-#if defined(__i386__)  
-/*******************************************************
- * Pentium versions of start_counter() and get_counter()
- *******************************************************/
-
-
-/* $begin x86cyclecounter */
-/* Initialize the cycle counter */
-static unsigned cyc_hi = 0;
-static unsigned cyc_lo = 0;
-
-
-/* Set *hi and *lo to the high and low order bits  of the cycle counter.  
-   Implementation requires assembly code to use the rdtsc instruction. */
-void access_counter(unsigned *hi, unsigned *lo)
+/* Does this CPU have an invariant TSC and rdtscp? */
+static int have_invariant_tsc(void)
 {
-    asm("rdtsc; movl %%edx,%0; movl %%eax,%1"   /* Read cycle counter */
-	: "=r" (*hi), "=r" (*lo)                /* and move results to */
-	: /* No input */                        /* the two outputs */
-	: "%edx", "%eax");
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+	return 0;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)
+	|| !(edx & (1u << 27)))  /* rdtscp */
+	return 0;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+	return 0;
+    return (edx & (1u << 8)) != 0; /* invariant TSC */
+#else
+    return 0;
+#endif
 }
 
-/* Record the current value of the cycle counter. */
-void start_counter()
+/* A TSC reading paired with the CLOCK_MONOTONIC_RAW time between the
+   two reads that bracket it */
+static void paired_read(uint64_t *tsc, uint64_t *ns)
 {
-    access_counter(&cyc_hi, &cyc_lo);
+    uint64_t t0 = clock_start_ticks();
+    *ns = clock_raw_ns();
+    *tsc = t0 + (clock_stop_ticks() - t0) / 2;
 }
 
-/* Return the number of cycles since the last call to start_counter. */
-double get_counter()
+/*
+ * init_clock - Choose the TSC or the fallback, and measure the TSC
+ *     rate against CLOCK_MONOTONIC_RAW over CAL_NSECS. This takes
+ *     10 ms rather than the seconds of sleeping in mhz_full.
+ */
+void init_clock(int verbose)
 {
-    unsigned ncyc_hi, ncyc_lo;
-    unsigned hi, lo, borrow;
-    double result;
-
-    /* Get cycle counter */
-    access_counter(&ncyc_hi, &ncyc_lo);
-
-    /* Do double precision subtraction */
-    lo = ncyc_lo - cyc_lo;
-    borrow = lo > ncyc_lo;
-    hi = ncyc_hi - cyc_hi - borrow;
-    result = (double) hi * (1 << 30) * 4 + lo;
-    if (result < 0) {
-	fprintf(stderr, "Error: counter returns neg value: %.0f\n", result);
+    uint64_t tsc0, tsc1, ns0, ns1;
+
+    if (clock_ready)
+	return;
+    clock_ready = 1;
+    if (!have_invariant_tsc()) {
+	if (verbose)
+	    printf("No invariant TSC; timing with CLOCK_MONOTONIC_RAW.\n");
+	return;
     }
-    return result;
+    clock_tsc = 1;
+    paired_read(&tsc0, &ns0);
+    do
+	paired_read(&tsc1, &ns1);
+    while (ns1 - ns0 < CAL_NSECS);
+    ticks_per_ns = (double)(tsc1 - tsc0) / (ns1 - ns0);
+    if (verbose)
+	printf("Invariant TSC at %.1f MHz.\n", ticks_per_ns * 1e3);
 }
-/* $end x86cyclecounter */
-
-#elif defined(__alpha)
-
-/****************************************************
- * Alpha versions of start_counter() and get_counter()
- ***************************************************/
 
-/* Initialize the cycle counter */
-static unsigned cyc_hi = 0;
-static unsigned cyc_lo = 0;
-
-
-/* Use Alpha cycle timer to compute cycles.  Then use
-   measured clock speed to compute seconds 
-*/
-
-/*
- * counterRoutine is an array of Alpha instructions to access 
- * the Alpha's processor cycle counter. It uses the rpcc 
- * instruction to access the counter. This 64 bit register is 
- * divided into two parts. The lower 32 bits are the cycles 
- * used by the current process. The upper 32 bits are wall 
- * clock cycles. These instructions read the counter, and 
- * convert the lower 32 bits into an unsigned int - this is the 
- * user space counter value.
- * NOTE: The counter has a very limited time span. With a 
- * 450MhZ clock the counter can time things for about 9 
- * seconds. */
-static unsigned int counterRoutine[] =
-{
-    0x601fc000u,
-    0x401f0000u,
-    0x6bfa8001u
-};
-
-/* Cast the above instructions into a function. */
-static unsigned int (*counter)(void)= (void *)counterRoutine;
-
-
-void start_counter()
+double clock_ticks_per_ns(void)
 {
-    /* Get cycle counter */
-    cyc_hi = 0;
-    cyc_lo = counter();
+    return ticks_per_ns;
 }
 
-double get_counter()
+/* Convert a tick count to nanoseconds */
+double clock_ticks_to_ns(uint64_t ticks)
 {
-    unsigned ncyc_hi, ncyc_lo;
-    unsigned hi, lo, borrow;
-    double result;
-    ncyc_lo = counter();
-    ncyc_hi = 0;
-    lo = ncyc_lo - cyc_lo;
-    borrow = lo > ncyc_lo;
-    hi = ncyc_hi - cyc_hi - borrow;
-    result = (double) hi * (1 << 30) * 4 + lo;
-    if (result < 0) {
-	fprintf(stderr, "Error: Cycle counter returning negative value: %.0f\n", result);
-    }
-    return result;
+    return ticks / ticks_per_ns;
 }
 
-#else
+/******************************************************* 
+ * start_counter() and get_counter() count TSC cycles, or
+ * nanoseconds where there is no usable TSC; mhz() gives the
+ * matching rate.
+ *******************************************************/
 
-/****************************************************************
- * All the other platforms for which we haven't implemented cycle
- * counter routines. Newer models of sparcs (v8plus) have cycle
- * counters that can be accessed from user programs, but since there
- * are still many sparc boxes out there that don't support this, we
- * haven't provided a Sparc version here.
- ***************************************************************/
+static uint64_t cyc_start = 0;
 
+/* Record the current value of the cycle counter. */
 void start_counter()
 {
-    printf("ERROR: You are trying to use a start_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    if (!clock_ready)
+	init_clock(0);
+    cyc_start = clock_start_ticks();
 }
 
-double get_counter() 
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
 {
-    printf("ERROR: You are trying to use a get_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    return (double)(clock_stop_ticks() - cyc_start);
 }
-#endif
-
-
 
 
 /*******************************
@@ -195,10 +153,13 @@ double mhz_full(int verbose, int sleeptime)
 }
 /* $end mhz */
 
-/* Version using a default sleeptime */
+/* Version using the rate init_clock measured, without sleeping */
 double mhz(int verbose)
 {
-    return mhz_full(verbose, 2);
+    init_clock(0);
+    if (verbose) 
+	printf("Processor clock rate ~= %.1f MHz\n", ticks_per_ns * 1e3);
+    return ticks_per_ns * 1e3;
 }
 
 /** Special counters that compensate for timer interrupt overhead */
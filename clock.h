@@ -1,4 +1,9 @@
 /* Routines for using cycle counter */
+#ifndef __CLOCK_H_
+#define __CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
 
 /* Start the counter */
 void start_counter();
@@ -9,7 +14,7 @@ double get_counter();
 /* Measure overhead for counter */
 double ovhd();
 
-/* Determine clock rate of processor (using a default sleeptime) */
+/* Determine clock rate of processor (as measured by init_clock) */
 double mhz(int verbose);
 
 /* Determine clock rate of processor, having more control over accuracy */
@@ -20,3 +25,53 @@ double mhz_full(int verbose, int sleeptime);
 void start_comp_counter();
 
 double get_comp_counter();
+
+/** Nanosecond timer: invariant TSC ticks, else CLOCK_MONOTONIC_RAW ns */
+
+/* Pick the tick source and measure its rate; safe to call again */
+void init_clock(int verbose);
+double clock_ticks_per_ns(void);
+double clock_ticks_to_ns(uint64_t ticks);
+
+extern int clock_tsc; /* set by init_clock when ticks come from the TSC */
+
+static inline uint64_t clock_raw_ns(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Ticks at the start of an interval: lfence keeps rdtsc from running
+   before the instructions ahead of it have completed */
+static inline uint64_t clock_start_ticks(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    if (clock_tsc) {
+	uint32_t hi, lo;
+	asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+	return ((uint64_t)hi << 32) | lo;
+    }
+#endif
+    return clock_raw_ns();
+}
+
+/* Ticks at the end of an interval: rdtscp waits for the timed code to
+   finish, and lfence keeps what follows from starting early */
+static inline uint64_t clock_stop_ticks(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    if (clock_tsc) {
+	uint32_t hi, lo, aux;
+	asm volatile("rdtscp; lfence" : "=a" (lo), "=d" (hi), "=c" (aux) : : "memory");
+	return ((uint64_t)hi << 32) | lo;
+    }
+#endif
+    return clock_raw_ns();
+}
+
+#endif /* __CLOCK_H_ */
@@ -57,10 +57,9 @@
 #define ALIGNMENT 16
 
 /*****************************************************************************
- * Set exactly one of these USE_xxx constants to "1" to select a timing method
+ * The timing method used unless mdriver -m picks another (see fsecs.h):
+ * FSECS_FCYC, FSECS_ITIMER, FSECS_GETTOD or FSECS_SAMPLE
  *****************************************************************************/
-#define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
-#define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define DEFAULT_TIMER FSECS_GETTOD
 
 #endif /* __CONFIG_H */
@@ -1,7 +1,22 @@
 /****************************
  * High-level timing wrappers
  ****************************/
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity */
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
@@ -12,6 +27,63 @@ static double Mhz;  /* estimated CPU clock frequency */
 
 extern int verbose; /* -v option in mdriver.c */
 
+static int timer = DEFAULT_TIMER;
+static fsecs_sample_t sampling = { 31, 3, -1 };
+static double *samples;      /* one per sample, for FSECS_SAMPLE */
+static double last_lo, last_hi; /* confidence interval of the last fsecs */
+static int last_outliers;
+
+#define BOOTSTRAP_ROUNDS 2000
+
+#define NUM_EVENTS 6
+
+static int counter_fd[NUM_EVENTS] = { -1, -1, -1, -1, -1, -1 };
+static int have_counters = 0; /* set once any counter is open */
+static double counter_runs;   /* runs of f in the last fsecs call */
+static fsecs_test_funct counted_f;
+
+static void reset_counters(void);
+static void counted(void *argp);
+static double fsecs_sample(fsecs_test_funct f, void *argp);
+
+/*
+ * set_fsecs_timer - Choose the timing method; call before init_fsecs
+ */
+void set_fsecs_timer(int t)
+{
+    timer = t;
+}
+
+void set_fsecs_sampling(const fsecs_sample_t *s)
+{
+    sampling = *s;
+    if (sampling.samples < 1)
+	sampling.samples = 1;
+    if (sampling.warmup < 0)
+	sampling.warmup = 0;
+}
+
+/*
+ * pin_cpu - Keep the driver, and any thread it starts later, on one
+ *     CPU, so that samples are not spread over cores with different
+ *     caches and clock speeds. cpu < 0 means the one we are on now.
+ */
+static void pin_cpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0 && (cpu = sched_getcpu()) < 0)
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	printf("Cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+    else if (verbose)
+	printf("Pinned to CPU %d.\n", cpu);
+#endif
+}
+
 /*
  * init_fsecs - initialize the timing package
  */
@@ -19,24 +91,38 @@ void init_fsecs(void)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
-    if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
-
-    /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
-    set_fcyc_epsilon(0.01);
-    set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
-#elif USE_ITIMER
-    if (verbose)
-	printf("Measuring performance with the interval timer.\n");
-#elif USE_GETTOD
-    if (verbose)
-	printf("Measuring performance with gettimeofday().\n");
-#endif
+    switch (timer) {
+    case FSECS_FCYC:
+	if (verbose)
+	    printf("Measuring performance with a cycle counter.\n");
+
+	/* set key parameters for the fcyc package */
+	set_fcyc_maxsamples(20); 
+	set_fcyc_clear_cache(1);
+	set_fcyc_compensate(1);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = mhz(verbose > 0);
+	break;
+    case FSECS_ITIMER:
+	if (verbose)
+	    printf("Measuring performance with the interval timer.\n");
+	break;
+    case FSECS_GETTOD:
+	if (verbose)
+	    printf("Measuring performance with gettimeofday().\n");
+	break;
+    case FSECS_SAMPLE:
+	if (verbose)
+	    printf("Measuring performance with %d samples after %d warmup runs.\n",
+		   sampling.samples, sampling.warmup);
+	if ((samples = malloc(sampling.samples * sizeof(double))) == NULL) {
+	    fprintf(stderr, "malloc failed in init_fsecs\n");
+	    exit(1);
+	}
+	pin_cpu(sampling.cpu);
+	break;
+    }
 }
 
 /*
@@ -44,14 +130,238 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
-    double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
-#endif 
+    double cycles, secs;
+
+    if (have_counters) {
+	reset_counters();
+	counted_f = f;
+	f = counted;
+    }
+    switch (timer) {
+    case FSECS_FCYC:
+	cycles = fcyc(f, argp);
+	secs = cycles/(Mhz*1e6);
+	break;
+    case FSECS_ITIMER:
+	secs = ftimer_itimer(f, argp, 10);
+	break;
+    case FSECS_SAMPLE:
+	return fsecs_sample(f, argp);
+    default:
+	secs = ftimer_gettod(f, argp, 10);
+	break;
+    }
+    last_lo = last_hi = secs;
+    last_outliers = 0;
+    return secs;
 }
 
+/*
+ * fsecs_interval - The 95% confidence interval of the median that the
+ *     last fsecs call returned, and how many of its samples were
+ *     dropped as outliers. Without FSECS_SAMPLE the interval is just
+ *     the estimate itself.
+ */
+void fsecs_interval(double *lo, double *hi, int *outliers)
+{
+    *lo = last_lo;
+    *hi = last_hi;
+    *outliers = last_outliers;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* median of the sorted s[0..n-1] */
+static double median(const double *s, int n)
+{
+    return n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+}
+
+/*
+ * fsecs_sample - Time sampling.samples runs of f after sampling.warmup
+ *     untimed ones. Samples outside Tukey's fences (1.5 interquartile
+ *     ranges beyond the quartiles) are dropped, e.g. runs hit by an
+ *     interrupt or a migration, and the median of the rest is
+ *     returned. Its confidence interval comes from a percentile
+ *     bootstrap: the 2.5th and 97.5th percentiles of the medians of
+ *     BOOTSTRAP_ROUNDS resamples, drawn with a fixed seed so that a
+ *     rerun on the same samples gives the same interval.
+ */
+static double fsecs_sample(fsecs_test_funct f, void *argp)
+{
+    static double *resample, *medians;
+    int n = sampling.samples, kept, i, r;
+    double q1, q3, iqr, med;
+    uint64_t rng = 88172645463325252ull;
+
+    if (resample == NULL) {
+	resample = malloc(n * sizeof(double));
+	medians = malloc(BOOTSTRAP_ROUNDS * sizeof(double));
+	if (resample == NULL || medians == NULL) {
+	    fprintf(stderr, "malloc failed in fsecs_sample\n");
+	    exit(1);
+	}
+    }
+
+    ftimer_clock(f, argp, sampling.warmup, n, samples);
+    qsort(samples, n, sizeof(double), cmp_double);
+
+    q1 = samples[n / 4];
+    q3 = samples[(3 * n) / 4];
+    iqr = q3 - q1;
+    for (i = kept = 0; i < n; i++)
+	if (samples[i] >= q1 - 1.5 * iqr && samples[i] <= q3 + 1.5 * iqr)
+	    samples[kept++] = samples[i];
+    last_outliers = n - kept;
+    med = median(samples, kept);
 
+    for (r = 0; r < BOOTSTRAP_ROUNDS; r++) {
+	for (i = 0; i < kept; i++) {
+	    rng ^= rng >> 12;
+	    rng ^= rng << 25;
+	    rng ^= rng >> 27;
+	    resample[i] = samples[(rng * 2685821657736338717ull >> 33) % kept];
+	}
+	qsort(resample, kept, sizeof(double), cmp_double);
+	medians[r] = median(resample, kept);
+    }
+    qsort(medians, BOOTSTRAP_ROUNDS, sizeof(double), cmp_double);
+    last_lo = medians[BOOTSTRAP_ROUNDS * 25 / 1000];
+    last_hi = medians[BOOTSTRAP_ROUNDS * 975 / 1000 - 1];
+    return med;
+}
+
+#ifdef __linux__
+
+/* what each counter_fd counts, in fsecs_counters_t order after runs */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} events[NUM_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1 misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "dTLB misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses" },
+};
+
+/*
+ * init_fsecs_counters - Open one user-space counter per event, all
+ *     disabled until a run of f. Each counter is opened on its own
+ *     rather than as a group, so that a CPU short of counters
+ *     multiplexes them (and read_counter scales the counts back up)
+ *     instead of failing the whole group. Returns the number opened.
+ */
+int init_fsecs_counters(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	counter_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (counter_fd[i] >= 0)
+	    n++;
+	else if (verbose)
+	    printf("Cannot count %s: %s\n", events[i].name, strerror(errno));
+    }
+    have_counters = n > 0;
+    if (!have_counters)
+	printf("Hardware counters are not available; reporting them as \"-\".\n");
+    return n;
+}
+
+static void reset_counters(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_EVENTS; i++)
+	if (counter_fd[i] >= 0)
+	    ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+    counter_runs = 0;
+}
+
+/* counted - Run counted_f with every counter of this process enabled */
+static void counted(void *argp)
+{
+    prctl(PR_TASK_PERF_EVENTS_ENABLE);
+    counted_f(argp);
+    prctl(PR_TASK_PERF_EVENTS_DISABLE);
+    counter_runs++;
+}
+
+/* read_counter - Event i's count, scaled for multiplexing, or -1 */
+static double read_counter(int i)
+{
+    uint64_t v[3]; /* value, time enabled, time running */
+
+    if (counter_fd[i] < 0 || read(counter_fd[i], v, sizeof(v)) != sizeof(v)
+	|| v[2] == 0)
+	return -1;
+    return (double)v[0] * v[1] / v[2];
+}
+
+#else /* !__linux__ */
+
+int init_fsecs_counters(void)
+{
+    printf("Hardware counters are not available; reporting them as \"-\".\n");
+    return 0;
+}
+
+static void reset_counters(void)
+{
+}
+
+static void counted(void *argp)
+{
+    counted_f(argp);
+}
+
+static double read_counter(int i)
+{
+    return -1;
+}
+
+#endif
+
+/*
+ * fsecs_counters - Per-run averages of the counters for the last
+ *     fsecs call
+ */
+void fsecs_counters(fsecs_counters_t *c)
+{
+    double v[NUM_EVENTS];
+    int i;
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+	v[i] = -1;
+	if (have_counters && counter_runs > 0 && (v[i] = read_counter(i)) >= 0)
+	    v[i] /= counter_runs;
+    }
+    c->runs = have_counters ? counter_runs : 0;
+    c->cycles = v[0];
+    c->instructions = v[1];
+    c->l1d_misses = v[2];
+    c->llc_misses = v[3];
+    c->dtlb_misses = v[4];
+    c->branch_misses = v[5];
+}
@@ -1,4 +1,39 @@
 typedef void (*fsecs_test_funct)(void *);
 
+/* timing methods for set_fsecs_timer */
+#define FSECS_FCYC   0 /* cycle counter w/K-best scheme */
+#define FSECS_ITIMER 1 /* interval timer, average of 10 runs */
+#define FSECS_GETTOD 2 /* gettimeofday, average of 10 runs */
+#define FSECS_SAMPLE 3 /* median of pinned, warmed-up samples */
+
+/* parameters of FSECS_SAMPLE */
+typedef struct {
+    int samples;  /* timed runs (31) */
+    int warmup;   /* untimed runs before them (3) */
+    int cpu;      /* CPU to pin to, < 0 for the current one */
+} fsecs_sample_t;
+
+void set_fsecs_timer(int timer);
+void set_fsecs_sampling(const fsecs_sample_t *s);
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+void fsecs_interval(double *lo, double *hi, int *outliers);
+
+/*
+ * Hardware counters (perf_event_open), read around each run of f by
+ * fsecs once init_fsecs_counters has opened them. fsecs_counters
+ * gives the per-run averages for the last fsecs call; an event the
+ * kernel or CPU cannot count is reported as -1.
+ */
+typedef struct {
+    double runs;          /* runs of f counted, 0 if there are no counters */
+    double cycles;
+    double instructions;
+    double l1d_misses;    /* L1 data cache read misses */
+    double llc_misses;    /* last-level cache misses */
+    double dtlb_misses;   /* data TLB read misses */
+    double branch_misses;
+} fsecs_counters_t;
+
+int init_fsecs_counters(void);
+void fsecs_counters(fsecs_counters_t *c);
@@ -7,8 +7,10 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_clock: one sample per run from CLOCK_MONOTONIC_RAW
  */
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
@@ -52,6 +54,32 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* 
+ * ftimer_clock - Time each of n runs of f(argp) separately, after
+ * warmup runs that are not timed. CLOCK_MONOTONIC_RAW is not slewed
+ * by NTP, so samples taken while the clock is being adjusted are
+ * still comparable.
+ */
+void ftimer_clock(ftimer_test_funct f, void *argp, int warmup, int n, double *secs)
+{
+#ifdef CLOCK_MONOTONIC_RAW
+    const clockid_t clk = CLOCK_MONOTONIC_RAW;
+#else
+    const clockid_t clk = CLOCK_MONOTONIC;
+#endif
+    struct timespec s, e;
+    int i;
+
+    for (i = 0; i < warmup; i++)
+	f(argp);
+    for (i = 0; i < n; i++) {
+	clock_gettime(clk, &s);
+	f(argp);
+	clock_gettime(clk, &e);
+	secs[i] = (e.tv_sec - s.tv_sec) + 1e-9 * (e.tv_nsec - s.tv_nsec);
+    }
+}
+
 
 /*
  * Routines for manipulating the Unix interval timer
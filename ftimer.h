@@ -12,3 +12,7 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* Time each of n runs of f(argp) on its own with CLOCK_MONOTONIC_RAW,
+   after warmup untimed runs, into secs[0..n-1] */
+void ftimer_clock(ftimer_test_funct f, void *argp, int warmup, int n, double *secs);
+
@@ -0,0 +1,56 @@
+/*
+ * glibc_alloc.c - allocator.h adapter for the C library's malloc,
+ *     built into glibc_alloc.so
+ *
+ * There is no way to start glibc over with an empty heap, and mdriver
+ * shares it. So init records the bytes allocated so far, mostly
+ * mdriver's, and heap_bytes is what glibc holds less those. Blocks a
+ * trace never frees stay allocated.
+ */
+#include <malloc.h>
+#include <stdlib.h>
+#include "allocator.h"
+
+static size_t base_allocated; /* allocated at the last init */
+
+static void glibc_held(size_t *heap, size_t *allocated)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    *heap = mi.arena + mi.hblkhd;
+    *allocated = mi.uordblks + mi.hblkhd;
+}
+
+static int glibc_init(void)
+{
+    size_t heap;
+
+    glibc_held(&heap, &base_allocated);
+    return 0;
+}
+
+static void glibc_stats(allocator_stats_t *stats)
+{
+    size_t heap, allocated;
+
+    glibc_held(&heap, &allocated);
+    stats->heap_bytes = heap > base_allocated ? heap - base_allocated : 0;
+    stats->allocated_bytes = allocated > base_allocated ? allocated - base_allocated : 0;
+}
+
+static const allocator_t glibc_allocator = {
+    ALLOCATOR_ABI_VERSION,
+    "glibc",
+    glibc_init,
+    malloc,
+    free,
+    realloc,
+    calloc,
+    malloc_usable_size,
+    glibc_stats
+};
+
+ALLOCATOR_EXPORT const allocator_t *allocator_entry(void)
+{
+    return &glibc_allocator;
+}
@@ -0,0 +1,182 @@
+/*
+ * kvtoy.c - A toy in-memory key-value server, as a malloc workload for
+ *     preload_bench.sh
+ *
+ *	unix> kvtoy [requests [threads]]
+ *
+ * Each thread serves its own shard: a chained hash table of string keys
+ * whose values are replaced, grown with realloc and deleted at random,
+ * the mix of small and odd-sized blocks a cache like memcached sees.
+ * Requests pick keys with a skew towards a hot set. The random streams
+ * are seeded per thread, so the printed checksum is the same under any
+ * malloc.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define BUCKETS 65536
+#define KEYS 200000     /* key space of each shard */
+#define MAX_VALUE 2048
+
+typedef struct entry {
+    struct entry *next;
+    char *key;
+    char *value;
+    size_t len;
+} entry_t;
+
+typedef struct {
+    entry_t **table;
+    long requests;
+    uint64_t seed;
+    uint64_t checksum;
+    long live;
+} shard_t;
+
+static uint64_t next_random(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static uint64_t hash(const char *k)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*k)
+	h = (h ^ (unsigned char)*k++) * 1099511628211ULL;
+    return h;
+}
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+
+    if (p == NULL) {
+	fprintf(stderr, "kvtoy: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+/* a value size: mostly small, sometimes up to MAX_VALUE */
+static size_t value_size(uint64_t *s)
+{
+    uint64_t r = next_random(s);
+
+    return (r & 7) ? 8 + r % 120 : 1 + r % MAX_VALUE;
+}
+
+static void fill(char *v, size_t len, uint64_t tag)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	v[i] = (char)(tag + i);
+}
+
+static void *serve(void *arg)
+{
+    shard_t *sh = arg;
+    char key[32];
+    long i;
+
+    sh->table = calloc(BUCKETS, sizeof(entry_t *));
+    if (sh->table == NULL) {
+	fprintf(stderr, "kvtoy: out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < sh->requests; i++) {
+	uint64_t r = next_random(&sh->seed);
+	/* a quarter of the requests go to the hottest 1% of the keys */
+	uint64_t k = (r & 3) ? r % KEYS : r % (KEYS / 100);
+	uint64_t h;
+	entry_t **pp, *e;
+	int op = (r >> 32) % 10;
+
+	snprintf(key, sizeof(key), "key:%llu", (unsigned long long)k);
+	h = hash(key) % BUCKETS;
+	for (pp = &sh->table[h]; (e = *pp) != NULL; pp = &e->next)
+	    if (strcmp(e->key, key) == 0)
+		break;
+
+	if (op < 5) {                       /* get */
+	    if (e)
+		sh->checksum += (unsigned char)e->value[e->len / 2] + e->len;
+	} else if (op < 8) {                /* set */
+	    size_t len = value_size(&sh->seed);
+
+	    if (e == NULL) {
+		e = xmalloc(sizeof(*e));
+		e->key = strdup(key);
+		e->value = NULL;
+		e->next = sh->table[h];
+		sh->table[h] = e;
+		sh->live++;
+	    }
+	    free(e->value);
+	    e->value = xmalloc(len);
+	    e->len = len;
+	    fill(e->value, len, r);
+	} else if (op < 9) {                /* append */
+	    if (e) {
+		size_t more = 1 + next_random(&sh->seed) % 64;
+		char *v = realloc(e->value, e->len + more);
+
+		if (v == NULL) {
+		    fprintf(stderr, "kvtoy: out of memory\n");
+		    exit(1);
+		}
+		fill(v + e->len, more, r);
+		e->value = v;
+		e->len += more;
+	    }
+	} else if (e) {                     /* delete */
+	    *pp = e->next;
+	    free(e->key);
+	    free(e->value);
+	    free(e);
+	    sh->live--;
+	}
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long requests = argc > 1 ? atol(argv[1]) : 2000000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    pthread_t tid[64];
+    shard_t shards[64];
+    uint64_t checksum = 0;
+    long live = 0;
+    int t;
+
+    if (requests < 1 || threads < 1 || threads > 64) {
+	fprintf(stderr, "usage: %s [requests [threads (1-64)]]\n", argv[0]);
+	exit(1);
+    }
+    for (t = 0; t < threads; t++) {
+	shards[t].requests = requests / threads;
+	shards[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+	shards[t].checksum = 0;
+	shards[t].live = 0;
+	if (pthread_create(&tid[t], NULL, serve, &shards[t]) != 0) {
+	    fprintf(stderr, "kvtoy: pthread_create failed\n");
+	    exit(1);
+	}
+    }
+    for (t = 0; t < threads; t++) {
+	pthread_join(tid[t], NULL);
+	checksum += shards[t].checksum;
+	live += shards[t].live;
+    }
+    printf("%ld live keys, checksum %llu\n", live,
+	   (unsigned long long)checksum);
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * lathist.c - Log-linear latency histograms timed with the cycle counter
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "lathist.h"
+
+#define CAL_SAMPLES 10001  /* empty start/stop pairs for the overhead */
+
+uint64_t lat_overhead = 0;
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * lat_calibrate - Set up the clock, and take the median of many empty
+ *     start/stop pairs as the overhead every recorded interval carries.
+ */
+void lat_calibrate(void)
+{
+    static uint64_t samples[CAL_SAMPLES];
+    uint64_t t0;
+    int i;
+
+    init_clock(0);
+    for (i = 0; i < CAL_SAMPLES; i++) {
+        t0 = clock_start_ticks();
+        samples[i] = clock_stop_ticks() - t0;
+    }
+    qsort(samples, CAL_SAMPLES, sizeof(uint64_t), cmp_u64);
+    lat_overhead = samples[CAL_SAMPLES / 2];
+}
+
+double lat_overhead_ns(void)
+{
+    return clock_ticks_to_ns(lat_overhead);
+}
+
+void lathist_clear(lathist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lathist_add(lathist_t *dst, const lathist_t *src)
+{
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* highest value that lands in bucket idx */
+static uint64_t bucket_top(int idx)
+{
+    int shift;
+    uint64_t next;
+
+    if (idx < LAT_SUB_COUNT)
+        return idx;
+    shift = (idx >> LAT_SUB_BITS) - 1;
+    next = (uint64_t)(idx & (LAT_SUB_COUNT - 1)) + LAT_SUB_COUNT + 1;
+    if (next > UINT64_MAX >> shift)
+        return UINT64_MAX;      /* the last bucket runs to the top */
+    return (next << shift) - 1;
+}
+
+/*
+ * lathist_percentile - The smallest recorded value that at least pct
+ *     percent of the samples do not exceed, to the bucket's precision
+ */
+double lathist_percentile(const lathist_t *h, double pct)
+{
+    uint64_t rank, seen = 0, top;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    rank = (uint64_t)ceil(pct / 100 * h->total);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            break;
+    }
+    top = bucket_top(i);
+    if (top > h->max)
+        top = h->max;
+    return clock_ticks_to_ns(top);
+}
+
+double lathist_max(const lathist_t *h)
+{
+    return clock_ticks_to_ns(h->max);
+}
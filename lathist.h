@@ -0,0 +1,57 @@
+/*
+ * lathist.h - Log-linear latency histograms timed with the cycle counter
+ */
+#include <stdint.h>
+#include "clock.h"
+
+/*
+ * Values below 2^LAT_SUB_BITS ticks get a bucket each; above that every
+ * power of two is split into 2^LAT_SUB_BITS linear sub-buckets, so a
+ * reported value is within 1/32 (3%) of the true one over the whole
+ * 64-bit range.
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((65 - LAT_SUB_BITS) << LAT_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t total;  /* number of samples */
+    uint64_t max;    /* largest sample, exact */
+} lathist_t;
+
+/*
+ * Intervals are clock_start_ticks() to clock_stop_ticks() from clock.h.
+ * lat_calibrate sets up the clock and measures the overhead of such a
+ * pair; call it once before recording.
+ */
+void lat_calibrate(void);
+double lat_overhead_ns(void);
+
+extern uint64_t lat_overhead; /* ticks taken by an empty start/stop pair */
+
+void lathist_clear(lathist_t *h);
+void lathist_add(lathist_t *dst, const lathist_t *src);
+
+/* Record the interval t1 - t0, less the calibrated timer overhead */
+static inline void lathist_record(lathist_t *h, uint64_t t0, uint64_t t1)
+{
+    uint64_t v = t1 - t0;
+    int idx;
+
+    v = v > lat_overhead ? v - lat_overhead : 0;
+    if (v < LAT_SUB_COUNT)
+        idx = (int)v;
+    else {
+        int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+        idx = ((shift + 1) << LAT_SUB_BITS) + (int)((v >> shift) - LAT_SUB_COUNT);
+    }
+    h->counts[idx]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* The pct-th percentile (0-100) and the maximum, in nanoseconds */
+double lathist_percentile(const lathist_t *h, double pct);
+double lathist_max(const lathist_t *h);
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -17,11 +19,20 @@
 #include <math.h>
 #include <inttypes.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "pagemap.h"
 #include "fsecs.h"
+#include "lathist.h"
+#include "allocator.h"
 #include "config.h"
 
 /**********************
@@ -31,8 +42,15 @@
 /* Misc */
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
+#define MAX_ALLOCATORS 8 /* most -A allocators in one run */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Long options, returned by getopt_long above any short option */
+#define OPT_JSON      256
+#define OPT_CSV       257
+#define OPT_BASELINE  258
+#define OPT_TOLERANCE 259
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
@@ -40,13 +58,22 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The records form a
+ * treap ordered by lo, so that checking a new payload for overlaps
+ * and removing a freed one take O(log n).
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned prio;         /* heap priority, random */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
 } range_t;
 
+/* range records are carved from chunks of this many and recycled */
+#define RANGE_POOL_CHUNK 4096
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
     enum {ALLOC, FREE, REALLOC} type; /* type of request */
@@ -58,13 +85,80 @@ typedef struct {
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
-    int num_ops;         /* number of distinct requests */
+    long num_ops;        /* number of distinct requests, which a streamed
+			    capture can take past INT_MAX */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or NULL for a binary trace */
+    const unsigned char *bin; /* a binary trace's encoded requests */
+    void *map;           /* the mapped binary trace file */
+    size_t map_len;
+    struct stream_t *stream; /* set when the requests are streamed (-z) */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/*
+ * Binary traces (made by traces/rep2bin.pl) start with TRACE_MAGIC,
+ * followed by sugg_heapsize, num_ids, num_ops and weight, and then one
+ * record per request: (zigzag(index - previous index) << 2 | type),
+ * where type is 0 for a, 1 for f and 2 for r, followed by the size for
+ * a and r. Every number is a BER compressed integer (perl's pack "w"):
+ * base 128, most significant group first, high bit set on all but the
+ * last byte. They are replayed straight from the mapping.
+ */
+#define TRACE_MAGIC "MMTB"
+
+/*
+ * A streamed trace (-z) is never held in memory. A producer thread
+ * decodes it from the file into one of two windows of STREAM_WINDOW
+ * requests while the replay consumes the other. Block ids are renamed
+ * to dense slots, reused once freed, so blocks and block_sizes only
+ * ever touch as many entries as there are live blocks. At the end of
+ * the trace the producer goes straight on to the next pass, so a
+ * rewind after a complete replay costs nothing and the timed replays
+ * do not pay for restarting it; only a replay that stopped early
+ * restarts it.
+ */
+#define STREAM_WINDOW 65536
+
+typedef struct stream_t {
+    char path[MAXLINE];
+    int binary;             /* TRACE_MAGIC format? */
+    long data_offset;       /* file offset of the first request */
+    long num_ops;
+    int num_ids;
+
+    traceop_t *buf[2];      /* the two windows */
+    int len[2];             /* requests in each window */
+    int last[2];            /* the window ends a pass over the trace */
+    int ready[2];           /* filled and not yet consumed */
+
+    /* consumer: the window it owns (-1 for none yet) and the next
+       request in it, and that window's len and last, copied under
+       the lock when it was taken */
+    int cur, pos;
+    int avail, at_end;
+    int stop;               /* tells the producer to quit */
+    int running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* producer: open-addressed id -> slot map, and the free slots */
+    unsigned *ids;          /* key + 1, 0 for an empty entry */
+    int *slots;
+    size_t map_size, map_used;
+    int *free_slots;
+    int num_free, next_slot;
+} stream_t;
+
+/* Walks the requests of a trace of either kind */
+typedef struct {
+    long i;                  /* next request of a text trace */
+    const unsigned char *p;  /* next record of a binary trace */
+    int index;               /* index of the previous binary request */
+} trace_cursor_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -73,28 +167,138 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    lathist_t *hist; /* if set, time each request into hist[type] */
+    const allocator_t *alloc; /* for eval_alloc_speed */
 } speed_t;
 
+/*
+ * The allocator calls that replay makes. A NULL realloc replays a
+ * realloc request as a malloc of the new size and a free of the old
+ * block, which is how mm.c and libc are driven. If set, after is
+ * called with arg once each request is done, before block_sizes is
+ * touched, for callers that account for every request.
+ */
+typedef struct {
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*after)(void *arg, trace_t *trace, const traceop_t *op);
+    void *arg;
+} replay_ops_t;
+
+static const replay_ops_t mm_ops = { mm_malloc, mm_free, NULL, NULL, NULL };
+static const replay_ops_t libc_ops = { malloc, free, NULL, NULL, NULL };
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double secs_lo;  /* 95% confidence interval of secs (-m sample) */
+    double secs_hi;
+    int outliers;    /* samples dropped as outliers (-m sample) */
 
     /* defined only for the student malloc package */
     double util;     /* overall space utilization for this trace (always 0 for libc) */
 
     double inst_util;     /* instanteous space utilization for this trace (always 0 for libc) */
 
+    double res_util;      /* peak payload over peak resident heap (mm only) */
+
+    double scan_avg;      /* free-list nodes visited per search (mm only) */
+    double scan_max;      /* longest free-list search (mm only) */
+
+    double warm_secs;     /* time for the first warmup_ops requests (mm only) */
+
+    double trim_bytes;    /* bytes released by mm_trim halfway through (mm only) */
+    double trim_secs;     /* time taken by that mm_trim call (mm only) */
+
+    double map_calls;     /* memlib traffic during the util pass (mm only) */
+    double unmap_calls;
+    double map_bytes;
+    double unmap_bytes;
+    double peak_bytes;    /* most memory mapped at once */
+    double map_secs;      /* total time in mem_map */
+    double unmap_secs;    /* total time in mem_unmap */
+    double sys_max_secs;  /* slowest single mem_map or mem_unmap */
+
+    fsecs_counters_t hw;  /* hardware counters per timed run (-H) */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/*
+ * The stats_t fields written by --json and --csv, in order, and read
+ * back by --baseline. KOPS is computed from ops and secs.
+ */
+typedef struct {
+    const char *name;
+    enum {STAT_DOUBLE, STAT_INT, STAT_KOPS} type;
+    size_t offset;
+} stat_field_t;
+
+#define STAT_FIELD(name, field, type) { name, type, offsetof(stats_t, field) }
+
+static const stat_field_t stat_fields[] = {
+    STAT_FIELD("valid", valid, STAT_INT),
+    STAT_FIELD("util", util, STAT_DOUBLE),
+    STAT_FIELD("util_i", inst_util, STAT_DOUBLE),
+    STAT_FIELD("ops", ops, STAT_DOUBLE),
+    STAT_FIELD("secs", secs, STAT_DOUBLE),
+    STAT_FIELD("kops", secs, STAT_KOPS),
+    STAT_FIELD("secs_lo", secs_lo, STAT_DOUBLE),
+    STAT_FIELD("secs_hi", secs_hi, STAT_DOUBLE),
+    STAT_FIELD("outliers", outliers, STAT_INT),
+    STAT_FIELD("util_r", res_util, STAT_DOUBLE),
+    STAT_FIELD("scan_avg", scan_avg, STAT_DOUBLE),
+    STAT_FIELD("scan_max", scan_max, STAT_DOUBLE),
+    STAT_FIELD("warm_secs", warm_secs, STAT_DOUBLE),
+    STAT_FIELD("trim_bytes", trim_bytes, STAT_DOUBLE),
+    STAT_FIELD("trim_secs", trim_secs, STAT_DOUBLE),
+    STAT_FIELD("map_calls", map_calls, STAT_DOUBLE),
+    STAT_FIELD("unmap_calls", unmap_calls, STAT_DOUBLE),
+    STAT_FIELD("map_bytes", map_bytes, STAT_DOUBLE),
+    STAT_FIELD("unmap_bytes", unmap_bytes, STAT_DOUBLE),
+    STAT_FIELD("peak_bytes", peak_bytes, STAT_DOUBLE),
+    STAT_FIELD("map_secs", map_secs, STAT_DOUBLE),
+    STAT_FIELD("unmap_secs", unmap_secs, STAT_DOUBLE),
+    STAT_FIELD("sys_max_secs", sys_max_secs, STAT_DOUBLE),
+    STAT_FIELD("hw_runs", hw.runs, STAT_DOUBLE),
+    STAT_FIELD("cycles", hw.cycles, STAT_DOUBLE),
+    STAT_FIELD("instructions", hw.instructions, STAT_DOUBLE),
+    STAT_FIELD("l1d_misses", hw.l1d_misses, STAT_DOUBLE),
+    STAT_FIELD("llc_misses", hw.llc_misses, STAT_DOUBLE),
+    STAT_FIELD("dtlb_misses", hw.dtlb_misses, STAT_DOUBLE),
+    STAT_FIELD("branch_misses", hw.branch_misses, STAT_DOUBLE),
+};
+
+#define NUM_STAT_FIELDS (sizeof(stat_fields) / sizeof(stat_fields[0]))
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
+static int show_scan = 0; /* print free-list scan columns (-s) */
+static size_t reserve_bytes = 0; /* mm_reserve size, 0 for none (-r) */
+static int reserve_flags = 0;    /* mm_reserve flags (-p) */
+static int warmup_ops = 0;       /* time the first warmup_ops requests (-w) */
+static int show_trim = 0;        /* time mm_trim on a fragmented heap (-T) */
+static int show_sys = 0;         /* print memlib map/unmap columns (-S) */
+static int show_resident = 0;    /* measure utilization against resident bytes (-R) */
+static int stream_traces = 0;    /* stream requests from disk (-z) */
+static int show_latency = 0;     /* print per-request latency percentiles (-P) */
+static int show_counters = 0;    /* print hardware counter columns (-H) */
+static int show_interval = 0;    /* print confidence intervals (-m sample) */
+static const allocator_t *allocators[MAX_ALLOCATORS]; /* loaded by -A */
+static int num_allocators = 0;
+static int check_mapped = 1;     /* add_range checks pages against memlib */
+static double kops_tolerance = 10; /* --baseline: allowed Kops drop, percent */
+static double util_tolerance = 1;  /* --baseline: allowed util drop, points */
+static mem_scatter_t scatter = { 0, 50, 25, 16, 0 }; /* memlib simulator (-D, -L) */
 static int errors = 0;  /* number of errs found when running student malloc */
+static range_t *range_pool = NULL; /* free range records, linked by left */
+static unsigned range_seed = 2463534242u; /* for range priorities */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -112,13 +316,22 @@ static char *default_tracefiles[] = {
 
 /* these functions manipulate range lists */
 static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum);
+		     int tracenum, long opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *new_range(void);
+static range_t *insert_range(range_t *t, range_t *p);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static void read_bin_trace(trace_t *trace, char *path);
+static void trace_rewind(trace_t *trace, trace_cursor_t *cur);
+static stream_t *open_stream(trace_t *trace, char *path);
+static void stream_start(stream_t *s);
+static void stream_stop(stream_t *s);
+static void stream_wait(stream_t *s);
+static inline int trace_next(trace_t *trace, trace_cursor_t *cur, traceop_t *op);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -127,14 +340,37 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio,
+			   double *res_ratio);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_warmup(trace_t *trace, int tracenum, int n);
+static double eval_mm_trim(trace_t *trace, int tracenum, double *released);
+static int init_mm(void);
+
+/* Routines for evaluating an allocator loaded with -A */
+static void load_allocator(char *path);
+static int eval_alloc_valid(trace_t *trace, int tracenum, const allocator_t *a,
+			    range_t **ranges);
+static double eval_alloc_util(trace_t *trace, int tracenum, const allocator_t *a);
+static void eval_alloc_speed(void *ptr);
+static void eval_alloc(trace_t *trace, int tracenum, const allocator_t *a,
+		       range_t **ranges, stats_t *st);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, lathist_t *hist);
+static void printcounters(double ops, fsecs_counters_t *hw);
+static void printcompare(int n, stats_t *stats);
+static size_t parse_size(char *s);
+static void add_mm_conf(char *opt);
+static void set_timer(char *spec);
+static void write_results(char *file, int csv, char **tracefiles, int n,
+			  stats_t *libc_stats, stats_t *alloc_stats, stats_t *mm_stats,
+			  double perfindex);
+static int check_baseline(char *file, char **tracefiles, int n, stats_t *mm_stats);
 static void usage(void);
 static void unix_error(char *msg);
-static void malloc_error(int tracenum, int opnum, char *msg);
+static void malloc_error(int tracenum, long opnum, char *msg);
 static void app_error(char *msg);
 
 /**************
@@ -142,18 +378,31 @@ static void app_error(char *msg);
  **************/
 int main(int argc, char **argv)
 {
-    int i;
-    char c;
+    int i, c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *alloc_stats = NULL; /* -A stats, num_tracefiles per allocator */
+    lathist_t *mm_lat = NULL;  /* mm latencies, one per request type per trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    mm_search_stats search;    /* free-list scan counters from eval_mm_util */
+    mem_stats_t sys;           /* memlib counters from eval_mm_util */
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    char *json_file = NULL;     /* write results as JSON (--json) */
+    char *csv_file = NULL;      /* write results as CSV (--csv) */
+    char *baseline_file = NULL; /* CSV results to compare against (--baseline) */
+    static const struct option long_options[] = {
+	{ "json", required_argument, NULL, OPT_JSON },
+	{ "csv", required_argument, NULL, OPT_CSV },
+	{ "baseline", required_argument, NULL, OPT_BASELINE },
+	{ "tolerance", required_argument, NULL, OPT_TOLERANCE },
+	{ NULL, 0, NULL, 0 }
+    };
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, inst_util, avg_mm_inst_util, avg_mm_util, avg_mm_throughput;
@@ -163,7 +412,8 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt_long(argc, argv, "f:t:hvVgalnspr:w:To:MSRD:L:G:zPHm:A:",
+			    long_options, NULL)) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -186,6 +436,80 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'n': /* Use next-fit instead of first-fit in mm.c */
+            add_mm_conf("fit=next");
+            break;
+        case 'o': /* Pass a key=value tuning option to mm.c */
+            add_mm_conf(optarg);
+            break;
+        case 'M': /* Use the reserve-then-commit memlib backend */
+            mem_set_backend(MEM_BACKEND_RESERVE);
+            break;
+        case 's': /* Print free-list scan statistics */
+            show_scan = 1;
+            break;
+        case 'r': /* Reserve heap memory in mm_init */
+            reserve_bytes = parse_size(optarg);
+            break;
+        case 'p': /* Prefault the reservation */
+            reserve_flags |= MM_RESERVE_PREFAULT;
+            break;
+        case 'w': /* Time the first n requests of each trace */
+            warmup_ops = atoi(optarg);
+            break;
+        case 'T': /* Time mm_trim halfway through each trace */
+            show_trim = 1;
+            break;
+        case 'S': /* Print memlib map/unmap counters */
+            show_sys = 1;
+            break;
+        case 'R': /* Compute utilization against resident memory */
+            show_resident = 1;
+            break;
+        case 'D': /* Scatter decoy mappings around the heap */
+            if (sscanf(optarg, "%u:%d:%d:%zu", &scatter.seed, &scatter.decoy_pct,
+                       &scatter.free_pct, &scatter.max_decoy_pages) < 1
+                || scatter.seed == 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'G': /* Simulate a larger page size */
+            mem_set_granule(parse_size(optarg));
+            break;
+        case 'L': /* Add latency to every mem_map and mem_unmap */
+            scatter.latency_ns = atol(optarg);
+            break;
+        case 'z': /* Stream traces instead of loading them */
+            stream_traces = 1;
+            break;
+        case 'P': /* Print per-request latency percentiles */
+            show_latency = 1;
+            break;
+        case 'H': /* Print hardware counters for the timed runs */
+            show_counters = 1;
+            break;
+        case 'm': /* Choose the timing method */
+            set_timer(optarg);
+            break;
+        case 'A': /* Load an allocator to compare */
+            load_allocator(optarg);
+            break;
+        case OPT_JSON: /* Write the results as JSON */
+            json_file = optarg;
+            break;
+        case OPT_CSV: /* Write the results as CSV */
+            csv_file = optarg;
+            break;
+        case OPT_BASELINE: /* Compare against results saved with --csv */
+            baseline_file = optarg;
+            break;
+        case OPT_TOLERANCE: /* Allowed Kops and util drops for --baseline */
+            if (sscanf(optarg, "%lf:%lf", &kops_tolerance, &util_tolerance) < 1) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -213,6 +537,16 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (show_counters)
+	init_fsecs_counters();
+    speed_params.hist = NULL;
+    if (show_latency) {
+	init_clock(verbose);
+	lat_calibrate();
+	if (verbose)
+	    printf("Timer overhead %.1f ns (%" PRIu64 " ticks)\n",
+		   lat_overhead_ns(), lat_overhead);
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -238,6 +572,9 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		fsecs_interval(&libc_stats[i].secs_lo, &libc_stats[i].secs_hi,
+			       &libc_stats[i].outliers);
+		fsecs_counters(&libc_stats[i].hw);
 	    }
 	    free_trace(trace);
 	}
@@ -249,6 +586,26 @@ int main(int argc, char **argv)
 	}
     }
 
+    /*
+     * Run every -A allocator on each trace in turn
+     */
+    if (num_allocators > 0) {
+	if ((alloc_stats = (stats_t *)calloc(num_allocators * num_tracefiles,
+					     sizeof(stats_t))) == NULL)
+	    unix_error("alloc_stats calloc in main failed");
+	for (i = 0; i < num_tracefiles; i++) {
+	    int a;
+
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    for (a = 0; a < num_allocators; a++)
+		eval_alloc(trace, i, allocators[a], &ranges,
+			   &alloc_stats[a * num_tracefiles + i]);
+	    free_trace(trace);
+	}
+	printf("\nAllocator comparison:\n");
+	printcompare(num_tracefiles, alloc_stats);
+    }
+
     /*
      * Always run and evaluate the student's mm package
      */
@@ -259,8 +616,12 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (show_latency &&
+	(mm_lat = (lathist_t *)calloc(3 * num_tracefiles, sizeof(lathist_t))) == NULL)
+	unix_error("mm_lat calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    mem_set_scatter(&scatter);
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
@@ -273,12 +634,40 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i].inst_util);
+	    mem_clear_stats();
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i].inst_util,
+						&mm_stats[i].res_util);
+	    mem_stats(&sys);
+	    mm_stats[i].map_calls = sys.map_calls;
+	    mm_stats[i].unmap_calls = sys.unmap_calls;
+	    mm_stats[i].map_bytes = sys.map_bytes;
+	    mm_stats[i].unmap_bytes = sys.unmap_bytes;
+	    mm_stats[i].peak_bytes = (double)sys.peak_pages * mem_pagesize();
+	    mm_stats[i].map_secs = sys.map_secs;
+	    mm_stats[i].unmap_secs = sys.unmap_secs;
+	    mm_stats[i].sys_max_secs = sys.map_max_secs > sys.unmap_max_secs ?
+		sys.map_max_secs : sys.unmap_max_secs;
+	    mm_get_search_stats(&search);
+	    if (search.searches > 0)
+		mm_stats[i].scan_avg = (double)search.nodes_visited / search.searches;
+	    mm_stats[i].scan_max = search.max_visited;
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    fsecs_interval(&mm_stats[i].secs_lo, &mm_stats[i].secs_hi,
+			   &mm_stats[i].outliers);
+	    fsecs_counters(&mm_stats[i].hw);
+	    if (show_latency) {
+		speed_params.hist = &mm_lat[3 * i];
+		eval_mm_speed(&speed_params);
+		speed_params.hist = NULL;
+	    }
+	    if (warmup_ops > 0)
+		mm_stats[i].warm_secs = eval_mm_warmup(trace, i, warmup_ops);
+	    if (show_trim)
+		mm_stats[i].trim_secs = eval_mm_trim(trace, i, &mm_stats[i].trim_bytes);
 	}
 	free_trace(trace);
     }
@@ -289,6 +678,11 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (show_latency) {
+	printf("Request latency for mm malloc (ns):\n");
+	printlatency(num_tracefiles, mm_lat);
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -343,6 +737,16 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    if (json_file)
+	write_results(json_file, 0, tracefiles, num_tracefiles,
+		      libc_stats, alloc_stats, mm_stats, perfindex);
+    if (csv_file)
+	write_results(csv_file, 1, tracefiles, num_tracefiles,
+		      libc_stats, alloc_stats, mm_stats, perfindex);
+    if (baseline_file && check_baseline(baseline_file, tracefiles,
+					num_tracefiles, mm_stats) > 0)
+	exit(2);
+
     exit(0);
 }
 
@@ -360,12 +764,11 @@ int main(int argc, char **argv)
  *     we create a range struct for this block and add it to the range list. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum)
+		     int tracenum, long opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *found;
     char msg[MAXLINE];
-    size_t page_size = mem_pagesize(), i;
 
     assert(size > 0);
 
@@ -377,43 +780,43 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
     
-    /* The payload must lie on a mapped page */
-    for (i = 0; i < size; i += page_size) {
-      if (!pagemap_is_mapped(lo+i)) {
+    /* The payload must lie on mapped pages */
+    if (check_mapped && !pagemap_is_range_mapped(lo, size)) {
 	sprintf(msg, "Payload (%p:%p) includes an unmapped page",
 		lo, hi);
 	malloc_error(tracenum, opnum, msg);
         return 0;
-      }
-    }
-    if (!pagemap_is_mapped(lo+size-1)) {
-      sprintf(msg, "Payload (%p:%p) ends at an unmapped page",
-              lo, hi);
-      malloc_error(tracenum, opnum, msg);
-      return 0;
-    }
-
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
+    }
+
+    /* 
+     * The payload must not overlap any other payloads. The recorded
+     * ranges are disjoint, so only the one starting last at or
+     * below hi can overlap.
+     */
+    found = NULL;
+    for (p = *ranges;  p != NULL; ) {
+        if (p->lo <= hi) {
+            found = p;
+            p = p->right;
         }
+        else
+            p = p->left;
+    }
+    if (found != NULL && found->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, found->lo, found->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it to the tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = new_range();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    *ranges = insert_range(*ranges, p);
     return 1;
 }
 
@@ -422,32 +825,107 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            free(p);
-            break;
+    range_t *p, **pp = ranges;
+
+    while ((p = *pp) != NULL && p->lo != lo)
+        pp = lo < p->lo ? &p->left : &p->right;
+    if (p == NULL)
+        return;
+
+    /* rotate p down until it has at most one child, then splice it out */
+    while (p->left != NULL && p->right != NULL) {
+        if (p->left->prio > p->right->prio) {
+            *pp = p->left;
+            p->left = (*pp)->right;
+            (*pp)->right = p;
+            pp = &(*pp)->right;
+        }
+        else {
+            *pp = p->right;
+            p->right = (*pp)->left;
+            (*pp)->left = p;
+            pp = &(*pp)->left;
         }
-        prevpp = &(p->next);
     }
+    *pp = p->left != NULL ? p->left : p->right;
+
+    p->left = range_pool;
+    range_pool = p;
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+        return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    p->left = range_pool;
+    range_pool = p;
+    *ranges = NULL;
+}
+
+/*
+ * new_range - Take a range record from the pool, refilling it a
+ *     chunk at a time
+ */
+static range_t *new_range(void)
 {
     range_t *p;
-    range_t *pnext;
+    int i;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGE_POOL_CHUNK * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in new_range");
+	for (i = 0; i < RANGE_POOL_CHUNK; i++) {
+	    p[i].left = range_pool;
+	    range_pool = &p[i];
+	}
     }
-    *ranges = NULL;
+    p = range_pool;
+    range_pool = p->left;
+
+    /* xorshift32 priorities keep the treap balanced on average */
+    range_seed ^= range_seed << 13;
+    range_seed ^= range_seed >> 17;
+    range_seed ^= range_seed << 5;
+    p->prio = range_seed;
+    p->left = p->right = NULL;
+    return p;
+}
+
+/*
+ * insert_range - Insert p into the treap t by lo and return the new root
+ */
+static range_t *insert_range(range_t *t, range_t *p)
+{
+    range_t *q;
+
+    if (t == NULL)
+        return p;
+    if (p->lo < t->lo) {
+        t->left = insert_range(t->left, p);
+        if (t->left->prio > t->prio) {
+            q = t->left;
+            t->left = q->right;
+            q->right = t;
+            t = q;
+        }
+    }
+    else {
+        t->right = insert_range(t->right, p);
+        if (t->right->prio > t->prio) {
+            q = t->right;
+            t->right = q->left;
+            q->left = t;
+            t = q;
+        }
+    }
+    return t;
 }
 
 
@@ -455,37 +933,105 @@ static void clear_ranges(range_t **ranges)
  * The following routines manipulate tracefiles
  *********************************************/
 
+/*
+ * scan_uint - Skip whitespace and read an unsigned decimal at *pp,
+ *     stopping at end. Returns -1 at end of input, at anything that
+ *     is not a digit, and for a value above LONG_MAX; callers check
+ *     their own narrower limits.
+ */
+static inline long scan_uint(const char **pp, const char *end)
+{
+    const char *p = *pp, *digits;
+    unsigned long n = 0;
+
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r'))
+	p++;
+    digits = p;
+    while (p < end && (unsigned)(*p - '0') < 10 && n <= LONG_MAX / 10)
+	n = n * 10 + (*p++ - '0');
+    if (p == digits || n > LONG_MAX || (p < end && (unsigned)(*p - '0') < 10))
+	return -1;
+    *pp = p;
+    return n;
+}
+
 /*
  * read_trace - read a trace file and store it in memory
+ *
+ * The file is mmapped and decoded with scan_uint rather than fscanf,
+ * which dominated the run time on traces of hundreds of megabytes.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
+    long index, size, hdr[4];
+    long max_index = 0;
+    long op_index;
+    int fd, i;
+    struct stat st;
+    const char *buf, *p, *end;
+    char type;
+    struct timespec t0, t1;
+    double secs;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
+    trace->ops = NULL;
+    trace->bin = NULL;
+    trace->map = NULL;
+    trace->stream = NULL;
+    if (stream_traces) {
+	trace->stream = open_stream(trace, path);
+	return trace;
+    }
+
+    /* Map the trace file */
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (st.st_size == 0) {
+	printf("Empty tracefile %s\n", path);
+	exit(1);
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+	sprintf(msg, "Could not mmap %s in read_trace", path);
+	unix_error(msg);
+    }
+    close(fd);
+    madvise((void *)buf, st.st_size, MADV_SEQUENTIAL);
+    p = buf;
+    end = buf + st.st_size;
+
+    if (st.st_size >= 4 && memcmp(buf, TRACE_MAGIC, 4) == 0) {
+	trace->map = (void *)buf;
+	trace->map_len = st.st_size;
+	read_bin_trace(trace, path);
+	goto done;
+    }
+
+    /* Read the trace file header */
+    for (i = 0; i < 4; i++)
+	if ((hdr[i] = scan_uint(&p, end)) < 0 || (i != 2 && hdr[i] > INT_MAX))
+	    break;
+    if (i < 4) {
+	printf("Truncated header in tracefile %s\n", path);
+	exit(1);
+    }
+    trace->sugg_heapsize = hdr[0]; /* not used */
+    trace->num_ids = hdr[1];
+    trace->num_ops = hdr[2];
+    trace->weight = hdr[3];        /* not used */
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
@@ -505,40 +1051,68 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
+    for (;;) {
+	while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r'))
+	    p++;
+	if (p == end)
 	    break;
+	type = *p++;
+	while (p < end && *p != ' ' && *p != '\n' && *p != '\t' && *p != '\r')
+	    p++;
+	if (op_index == trace->num_ops) {
+	    printf("More requests than the %ld in the header of tracefile %s\n",
+		   trace->num_ops, path);
+	    exit(1);
+	}
+	switch(type) {
+	case 'a':
 	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
+	    if ((index = scan_uint(&p, end)) < 0 || (size = scan_uint(&p, end)) < 0
+		|| size > INT_MAX)
+		goto bad;
+	    trace->ops[op_index].type = type == 'a' ? ALLOC : REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
-	    fscanf(tracefile, "%ud", &index);
+	    if ((index = scan_uint(&p, end)) < 0)
+		goto bad;
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
+		   type, path);
+	    exit(1);
+	}
+	if (index >= trace->num_ids) {
+	    printf("Request %ld uses id %ld, beyond the %d in the header of tracefile %s\n",
+		   op_index, index, trace->num_ids, path);
 	    exit(1);
 	}
 	op_index++;
 	
     }
-    fclose(tracefile);
+    munmap((void *)buf, st.st_size);
+    if (op_index < trace->num_ops) {
+	printf("Only %ld of the %ld requests in the header of tracefile %s\n",
+	       op_index, trace->num_ops, path);
+	exit(1);
+    }
     assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+
+ done:
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (verbose > 1)
+	printf("Parsed %.1f MB in %.3f secs (%.0f MB/s)\n",
+	       st.st_size / 1e6, secs, st.st_size / 1e6 / secs);
     
     return trace;
+ bad:
+    printf("Truncated or bad request %ld in tracefile %s\n", op_index, path);
+    exit(1);
 }
 
 /*
@@ -547,23 +1121,545 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
+    stream_t *s = trace->stream;
+
+    if (s != NULL) {
+	stream_stop(s);
+	munmap(trace->blocks, s->num_ids * sizeof(char *));
+	munmap(trace->block_sizes, s->num_ids * sizeof(size_t));
+	free(s->buf[0]);
+	free(s->buf[1]);
+	free(s->ids);
+	free(s->slots);
+	free(s->free_slots);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	free(trace);
+	return;
+    }
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_len);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * get_ber - Decode the BER compressed integer at *pp, or return -1 if
+ *     it runs past end or overflows
+ */
+static inline long get_ber(const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    unsigned long n = 0;
+
+    do {
+	if (p == end || n >> 56)
+	    return -1;
+	n = (n << 7) | (*p & 0x7f);
+    } while (*p++ & 0x80);
+    *pp = p;
+    return n > LONG_MAX ? -1 : (long)n;
+}
+
+/*
+ * read_bin_trace - Check the header and every record of a mapped
+ *     binary trace once, so that trace_next can decode it unchecked
+ */
+static void read_bin_trace(trace_t *trace, char *path)
+{
+    const unsigned char *p = (const unsigned char *)trace->map + 4;
+    const unsigned char *end = (const unsigned char *)trace->map + trace->map_len;
+    long v, max_index = -1, index = 0, hdr[4], i;
+
+    for (i = 0; i < 4; i++)
+	if ((hdr[i] = get_ber(&p, end)) < 0 || (i != 2 && hdr[i] > INT_MAX)) {
+	    printf("Truncated header in tracefile %s\n", path);
+	    exit(1);
+	}
+    trace->sugg_heapsize = hdr[0];
+    trace->num_ids = hdr[1];
+    trace->num_ops = hdr[2];
+    trace->weight = hdr[3];
+    trace->ops = NULL;
+    trace->bin = p;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	if ((v = get_ber(&p, end)) < 0 || (v & 3) == 3)
+	    goto bad;
+	index += (v >> 2 & 1) ? -(v >> 3) - 1 : v >> 3;
+	if (index < 0 || index >= trace->num_ids)
+	    goto bad;
+	if ((v & 3) != 1) {
+	    if ((v = get_ber(&p, end)) < 0 || v > INT_MAX)
+		goto bad;
+	    if (index > max_index)
+		max_index = index;
+	}
+    }
+    if (p != end || max_index != trace->num_ids - 1)
+	goto bad;
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_bin_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_bin_trace");
+    return;
+
+ bad:
+    printf("Corrupt request %ld in binary tracefile %s\n", i, path);
+    exit(1);
+}
+
+/*
+ * trace_rewind - Point cur at the first request of a trace
+ */
+static void trace_rewind(trace_t *trace, trace_cursor_t *cur)
+{
+    stream_t *s = trace->stream;
+
+    if (s != NULL) {
+	/* before the first window or after the last request of a pass,
+	   the producer is already on the next pass */
+	int boundary = s->cur < 0 || (s->at_end && s->pos == s->avail);
+
+	if (!s->running || !boundary)
+	    stream_start(s);
+    }
+    cur->i = 0;
+    cur->p = trace->bin;
+    cur->index = 0;
+}
+
+/*
+ * trace_next - Store the request at cur in op and advance. Always
+ *     returns 1, so it can sit in a loop condition; callers stop after
+ *     num_ops requests.
+ */
+static inline int trace_next(trace_t *trace, trace_cursor_t *cur, traceop_t *op)
+{
+    const unsigned char *p;
+    unsigned long v, n;
+
+    if (trace->ops != NULL) {
+	*op = trace->ops[cur->i++];
+	return 1;
+    }
+
+    if (trace->bin == NULL) {
+	stream_t *s = trace->stream;
+
+	if (s->pos == s->avail)
+	    stream_wait(s);
+	*op = s->buf[s->cur][s->pos++];
+	return 1;
+    }
+
+    /* validated by read_bin_trace, so no bounds checks */
+    p = cur->p;
+    for (v = 0; *p & 0x80; p++)
+	v = (v << 7) | (*p & 0x7f);
+    v = (v << 7) | *p++;
+    cur->index += (v >> 2 & 1) ? -(long)(v >> 3) - 1 : (long)(v >> 3);
+    op->index = cur->index;
+    op->type = (v & 3) == 0 ? ALLOC : (v & 3) == 1 ? FREE : REALLOC;
+    if (op->type != FREE) {
+	for (n = 0; *p & 0x80; p++)
+	    n = (n << 7) | (*p & 0x7f);
+	n = (n << 7) | *p++;
+	op->size = n;
+    }
+    cur->p = p;
+    return 1;
+}
+
+/*
+ * fget_uint - Skip whitespace and read an unsigned decimal from f, or
+ *     return -1 at end of file, at anything that is not a digit, and
+ *     for a value above LONG_MAX
+ */
+static long fget_uint(FILE *f)
+{
+    int c, digits = 0;
+    unsigned long n = 0;
+
+    while ((c = getc_unlocked(f)) == ' ' || c == '\n' || c == '\t' || c == '\r')
+	;
+    for (; (unsigned)(c - '0') < 10 && n <= LONG_MAX / 10; c = getc_unlocked(f), digits++)
+	n = n * 10 + (c - '0');
+    if (c != EOF)
+	ungetc(c, f);
+    if (!digits || n > LONG_MAX || (unsigned)(c - '0') < 10)
+	return -1;
+    return n;
+}
+
+/*
+ * fget_ber - Read a BER compressed integer from f, or return -1 at end
+ *     of file
+ */
+static long fget_ber(FILE *f)
+{
+    int c;
+    long n = 0;
+
+    do {
+	if ((c = getc_unlocked(f)) == EOF)
+	    return -1;
+	n = (n << 7) | (c & 0x7f);
+    } while (c & 0x80);
+    return n;
+}
+
+/*
+ * open_stream - Read the header of a trace to be streamed, and reserve
+ *     blocks and block_sizes with MAP_NORESERVE so that only the pages
+ *     of slots actually used become resident
+ */
+static stream_t *open_stream(trace_t *trace, char *path)
+{
+    stream_t *s;
+    FILE *f;
+    char magic[4];
+    long hdr[4];
+    int i;
+
+    if ((s = (stream_t *)calloc(1, sizeof(stream_t))) == NULL)
+	unix_error("calloc failed in open_stream");
+    strcpy(s->path, path);
+    if ((f = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    s->binary = fread(magic, 1, 4, f) == 4 && memcmp(magic, TRACE_MAGIC, 4) == 0;
+    if (!s->binary)
+	rewind(f);
+    for (i = 0; i < 4; i++)
+	if ((hdr[i] = s->binary ? fget_ber(f) : fget_uint(f)) < 0 ||
+	    (i != 2 && hdr[i] > INT_MAX)) {
+	    printf("Truncated header in tracefile %s\n", path);
+	    exit(1);
+	}
+    s->data_offset = ftell(f);
+    fclose(f);
+
+    trace->sugg_heapsize = hdr[0];
+    trace->num_ids = s->num_ids = hdr[1];
+    trace->num_ops = s->num_ops = hdr[2];
+    trace->weight = hdr[3];
+    trace->blocks = mmap(NULL, s->num_ids * sizeof(char *), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    trace->block_sizes = mmap(NULL, s->num_ids * sizeof(size_t), PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (trace->blocks == MAP_FAILED || trace->block_sizes == MAP_FAILED)
+	unix_error("mmap failed in open_stream");
+
+    if ((s->buf[0] = malloc(STREAM_WINDOW * sizeof(traceop_t))) == NULL
+	|| (s->buf[1] = malloc(STREAM_WINDOW * sizeof(traceop_t))) == NULL
+	|| (s->free_slots = malloc(s->num_ids * sizeof(int))) == NULL)
+	unix_error("malloc failed in open_stream");
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    return s;
+}
+
+/*
+ * id_slot - Find the slot of block id in the producer's map, inserting
+ *     it with slot -1 if it is new. Returns the map entry.
+ */
+static size_t id_slot(stream_t *s, unsigned id)
+{
+    size_t i, n, mask;
+    unsigned *old_ids;
+    int *old_slots;
+
+    if (2 * (s->map_used + 1) > s->map_size) {
+	old_ids = s->ids;
+	old_slots = s->slots;
+	n = s->map_size;
+	s->map_size = n ? 2 * n : 1024;
+	s->ids = calloc(s->map_size, sizeof(unsigned));
+	s->slots = malloc(s->map_size * sizeof(int));
+	if (s->ids == NULL || s->slots == NULL)
+	    unix_error("malloc failed in id_slot");
+	mask = s->map_size - 1;
+	for (i = 0; i < n; i++) {
+	    size_t j;
+	    if (old_ids[i] == 0)
+		continue;
+	    for (j = (old_ids[i] * 2654435761u) & mask; s->ids[j]; j = (j + 1) & mask)
+		;
+	    s->ids[j] = old_ids[i];
+	    s->slots[j] = old_slots[i];
+	}
+	free(old_ids);
+	free(old_slots);
+    }
+
+    mask = s->map_size - 1;
+    for (i = ((id + 1) * 2654435761u) & mask; s->ids[i]; i = (i + 1) & mask)
+	if (s->ids[i] == id + 1)
+	    return i;
+    s->ids[i] = id + 1;
+    s->slots[i] = -1;
+    s->map_used++;
+    return i;
+}
+
+/*
+ * id_remove - Delete entry i of the producer's map, shifting later
+ *     entries of its probe run back so lookups still find them
+ */
+static void id_remove(stream_t *s, size_t i)
+{
+    size_t mask = s->map_size - 1, j = i, home;
+
+    for (;;) {
+	j = (j + 1) & mask;
+	if (s->ids[j] == 0)
+	    break;
+	home = (s->ids[j] * 2654435761u) & mask;
+	/* move j back to i unless its home lies cyclically in (i, j] */
+	if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+	    s->ids[i] = s->ids[j];
+	    s->slots[i] = s->slots[j];
+	    i = j;
+	}
+    }
+    s->ids[i] = 0;
+    s->map_used--;
+}
+
+/*
+ * stream_thread - The producer: decode requests into whichever window
+ *     the replay has finished with, renaming ids to slots
+ */
+static void *stream_thread(void *arg)
+{
+    stream_t *s = (stream_t *)arg;
+    FILE *f;
+    int b = 0, n, stop;
+    long v, index = 0, size = 0, done = 0;
+    size_t e;
+    traceop_t *op;
+
+    if (s->num_ops == 0)
+	return NULL;
+    if ((f = fopen(s->path, "r")) == NULL)
+	unix_error("fopen failed in stream_thread");
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+ pass:
+    fseek(f, s->data_offset, SEEK_SET);
+    if (s->ids != NULL)
+	memset(s->ids, 0, s->map_size * sizeof(unsigned));
+    s->map_used = 0;
+    s->num_free = 0;
+    s->next_slot = 0;
+    index = 0;
+    done = 0;
+    while (done < s->num_ops) {
+	pthread_mutex_lock(&s->lock);
+	while (s->ready[b] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	if (stop) {
+	    fclose(f);
+	    return NULL;
+	}
+
+	for (n = 0; n < STREAM_WINDOW && done < s->num_ops; n++, done++) {
+	    op = &s->buf[b][n];
+	    if (s->binary) {
+		if ((v = fget_ber(f)) < 0 || (v & 3) == 3)
+		    goto bad;
+		index += (v >> 2 & 1) ? -(v >> 3) - 1 : v >> 3;
+		op->type = (v & 3) == 0 ? ALLOC : (v & 3) == 1 ? FREE : REALLOC;
+		if (op->type != FREE && (size = fget_ber(f)) < 0)
+		    goto bad;
+	    }
+	    else {
+		int c;
+		while ((c = getc_unlocked(f)) == ' ' || c == '\n' || c == '\t' || c == '\r')
+		    ;
+		while ((v = getc_unlocked(f)) != EOF && v != ' ' && v != '\n' && v != '\t')
+		    ;
+		op->type = c == 'a' ? ALLOC : c == 'f' ? FREE : REALLOC;
+		if (c != 'a' && c != 'f' && c != 'r')
+		    goto bad;
+		index = fget_uint(f);
+		if (op->type != FREE && (size = fget_uint(f)) < 0)
+		    goto bad;
+	    }
+	    if (index < 0 || index >= s->num_ids || size > INT_MAX)
+		goto bad;
+
+	    e = id_slot(s, index);
+	    if (s->slots[e] < 0)
+		s->slots[e] = s->num_free ? s->free_slots[--s->num_free] : s->next_slot++;
+	    op->index = s->slots[e];
+	    op->size = size;
+	    if (op->type == FREE) {
+		s->free_slots[s->num_free++] = s->slots[e];
+		id_remove(s, e);
+	    }
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->len[b] = n;
+	s->last[b] = done == s->num_ops;
+	s->ready[b] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	b ^= 1;
+    }
+    goto pass;
+
+ bad:
+    printf("Bad request %ld in tracefile %s\n", done, s->path);
+    exit(1);
+}
+
+/*
+ * stream_start - Restart the producer at the first request
+ */
+static void stream_start(stream_t *s)
+{
+    stream_stop(s);
+    s->ready[0] = s->ready[1] = 0;
+    s->len[0] = s->len[1] = 0;
+    s->last[0] = s->last[1] = 0;
+    s->cur = -1;
+    s->pos = s->avail = 0;
+    s->at_end = 0;
+    s->stop = 0;
+    if (pthread_create(&s->thread, NULL, stream_thread, s) != 0)
+	unix_error("pthread_create failed in stream_start");
+    s->running = 1;
+}
+
+/*
+ * stream_stop - Stop the producer, which may still be ahead of a replay
+ *     that ended early
+ */
+static void stream_stop(stream_t *s)
+{
+    if (!s->running)
+	return;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    s->running = 0;
+}
+
+/*
+ * stream_wait - Hand the owned window, if any, back to the producer and
+ *     wait for the next one
+ */
+static void stream_wait(stream_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->cur >= 0) {
+	s->ready[s->cur] = 0;
+	s->cur ^= 1;
+    } else
+	s->cur = 0;
+    pthread_cond_broadcast(&s->cond);
+    while (!s->ready[s->cur])
+	pthread_cond_wait(&s->cond, &s->lock);
+    s->avail = s->len[s->cur];
+    s->at_end = s->last[s->cur];
+    pthread_mutex_unlock(&s->lock);
+    s->pos = 0;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * replay - Run the first n requests of a trace against ops, keeping
+ *     the blocks in trace->blocks. With touch set every new payload is
+ *     zeroed, as a real program would; with a hist array every request
+ *     is timed into the histogram for its type. A failed allocation is
+ *     fatal, reported as from who. Inlined into each caller, so the
+ *     timed loops call the allocator directly and test no flag they
+ *     were not given.
+ */
+static inline __attribute__((always_inline))
+void replay(trace_t *trace, long n, const replay_ops_t *ops, int touch,
+	    lathist_t *hist, const char *who)
+{
+    long i;
+    trace_cursor_t cur;  /* position in the trace */
+    traceop_t op;        /* the current request */
+    char *p, msg[MAXLINE];
+    uint64_t t0 = 0;
+
+    trace_rewind(trace, &cur);
+    for (i = 0;  i < n && trace_next(trace, &cur, &op);  i++) {
+	if (hist)
+	    t0 = clock_start_ticks();
+        switch (op.type) {
+
+        case ALLOC: /* malloc */
+	    if ((p = ops->malloc(op.size)) == NULL)
+		goto fail;
+	    if (touch)
+		memset(p, 0, op.size);
+	    trace->blocks[op.index] = p;
+	    break;
+
+	case REALLOC: /* realloc, or malloc + free */
+	    if (ops->realloc) {
+		if ((p = ops->realloc(trace->blocks[op.index], op.size)) == NULL)
+		    goto fail;
+	    } else {
+		if ((p = ops->malloc(op.size)) == NULL)
+		    goto fail;
+		if (touch)
+		    memset(p, 0, op.size);
+		ops->free(trace->blocks[op.index]);
+	    }
+	    trace->blocks[op.index] = p;
+	    break;
+
+        case FREE: /* free */
+	    ops->free(trace->blocks[op.index]);
+	    break;
+
+	default:
+	    sprintf(msg, "Nonexistent request type in %s", who);
+	    app_error(msg);
+        }
+	if (hist)
+	    lathist_record(&hist[op.type], t0, clock_stop_ticks());
+	if (ops->after)
+	    ops->after(ops->arg, trace, &op);
+    }
+    return;
+
+ fail:
+    sprintf(msg, "%s failed in %s", op.type == ALLOC ? "malloc" : "realloc", who);
+    app_error(msg);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i;
+    long i;
+    trace_cursor_t cur;  /* position in the trace */
+    traceop_t op;        /* the current request */
     int index;
     int size;
     char *newp;
@@ -574,17 +1670,18 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    if (init_mm() < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    trace_rewind(trace, &cur);
+    for (i = 0;  i < trace->num_ops && trace_next(trace, &cur, &op);  i++) {
+	index = op.index;
+	size = op.size;
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -670,31 +1767,40 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   is always the high water mark of the heap. 
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio,
+			   double *res_ratio)
 {   
-    int i;
+    long i;
+    trace_cursor_t cur;  /* position in the trace */
+    traceop_t op;        /* the current request */
     int index;
     int size, newsize, oldsize;
     size_t max_total_size = 0, max_heap_size = 0;
     size_t heap_size = 0, total_size = 0;
+    size_t resident_size, max_resident_size = 0;
     double ratio, ratio_frac, accum_ratio_frac = 1.0, accum_ratio_exp = 0.0;
     int ratio_exp;
     char *p;
     char *newp, *oldp;
 
     /* initialize the heap and the mm malloc package */
-    if (mm_init() < 0)
+    if (init_mm() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    trace_rewind(trace, &cur);
+    for (i = 0;  i < trace->num_ops && trace_next(trace, &cur, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
+
+	    /* an application touches what it allocates */
+	    if (show_resident)
+		memset(p, index & 0xFF, size);
 	    
 	    /* Remember region and size */
 	    trace->blocks[index] = p;
@@ -707,13 +1813,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
             break;
 
 	case REALLOC: /* mm_mealloc + mm_free */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_malloc(newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
+	    if (show_resident)
+		memset(newp, index & 0xFF, newsize);
 
             mm_free(oldp);
 
@@ -728,7 +1836,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -755,6 +1863,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
         if (heap_size > max_heap_size)
           max_heap_size = heap_size;
 
+        /* mincore over the whole heap, so only when asked for */
+        if (show_resident) {
+          resident_size = mem_resident_size();
+          if (resident_size > max_resident_size)
+            max_resident_size = resident_size;
+        }
+
         ratio = (double)(total_size + 1) / (heap_size + 1);
 
         ratio_frac = frexp(ratio, &ratio_exp);
@@ -775,6 +1890,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
     // printf("%ld %f\n", max_total_size, ratio);
 
     *inst_ratio = ratio;
+    *res_ratio = show_resident ? (double)max_total_size / (max_resident_size + 1) : 0;
 
     return (double)max_total_size / max_heap_size;;
 }
@@ -782,51 +1898,80 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ *    to measure the running time of the mm malloc package. With
+ *    a hist array (-P) it also times every request on its own,
+ *    into the histogram for its type; a realloc is timed as its
+ *    mm_malloc plus mm_free.
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
-    if (mm_init() < 0) 
+    if (init_mm() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    replay(trace, trace->num_ops, &mm_ops, 0, ((speed_t *)ptr)->hist,
+	   "eval_mm_speed");
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+    mem_reset();
+}
 
-	case REALLOC: /* mm_malloc + mm_free */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-            if ((newp = mm_malloc(newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            mm_free(oldp);
-            trace->blocks[index] = newp;
-            break;
+/*
+ * eval_mm_warmup - Time the first n requests of a trace on a fresh
+ *    heap, i.e. the growth and first-touch cost that -r/-p avoid.
+ *    The reservation itself is made before the clock starts.
+ */
+static double eval_mm_warmup(trace_t *trace, int tracenum, int n)
+{
+    struct timespec start, end;
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
-            mm_free(block);
-            break;
+    if (init_mm() < 0)
+	app_error("mm_init failed in eval_mm_warmup");
 
-	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
-        }
+    if (n > trace->num_ops)
+	n = trace->num_ops;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* touch the payloads, as a real program would */
+    replay(trace, n, &mm_ops, 1, NULL, "eval_mm_warmup");
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
     mem_reset();
+
+    return (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * eval_mm_trim - Replay the first half of a trace, so that the heap is
+ *    fragmented with live blocks, then time a single mm_trim(0).
+ */
+static double eval_mm_trim(trace_t *trace, int tracenum, double *released)
+{
+    struct timespec start, end;
+
+    if (init_mm() < 0)
+	app_error("mm_init failed in eval_mm_trim");
+
+    replay(trace, trace->num_ops / 2, &mm_ops, 1, NULL, "eval_mm_trim");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *released = mm_trim(0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    mem_reset();
+
+    return (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * init_mm - Initialize the mm package, with a reservation if -r was given
+ */
+static int init_mm(void)
+{
+    if (reserve_bytes > 0)
+	return mm_init_with_reserve(reserve_bytes, reserve_flags);
+    return mm_init();
 }
 
 /*
@@ -837,32 +1982,36 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    long i;
+    int newsize;
+    trace_cursor_t cur;  /* position in the trace */
+    traceop_t op;        /* the current request */
     char *p, *newp, *oldp;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    trace_rewind(trace, &cur);
+    for (i = 0;  i < trace->num_ops && trace_next(trace, &cur, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op.size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op.index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+	    oldp = trace->blocks[op.index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op.index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op.index]);
 	    break;
 
 	default:
@@ -880,38 +2029,259 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    replay(trace, trace->num_ops, &libc_ops, 0, NULL, "eval_libc_speed");
+}
+
+/*
+ * load_allocator - dlopen an allocator shared object (see allocator.h)
+ *     and add it to the ones compared. A path without a slash is
+ *     looked up like any other library, so use ./name.so for one in
+ *     the current directory.
+ */
+static void load_allocator(char *path)
+{
+    void *handle;
+    allocator_entry_t entry;
+    const allocator_t *a;
+
+    if (num_allocators == MAX_ALLOCATORS) {
+	fprintf(stderr, "At most %d allocators can be compared\n", MAX_ALLOCATORS);
+	exit(1);
+    }
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	fprintf(stderr, "Could not load %s: %s\n", path, dlerror());
+	exit(1);
+    }
+    if ((entry = (allocator_entry_t)dlsym(handle, ALLOCATOR_ENTRY)) == NULL ||
+	(a = entry()) == NULL) {
+	fprintf(stderr, "%s does not export %s\n", path, ALLOCATOR_ENTRY);
+	exit(1);
+    }
+    if (a->abi_version != ALLOCATOR_ABI_VERSION) {
+	fprintf(stderr, "%s has allocator ABI version %d, not %d\n",
+		path, a->abi_version, ALLOCATOR_ABI_VERSION);
+	exit(1);
+    }
+    allocators[num_allocators++] = a;
+}
+
+/* free_ranges - Free every block left in the range tree */
+static void free_ranges(range_t *p, const allocator_t *a)
+{
+    if (p == NULL)
+	return;
+    free_ranges(p->left, a);
+    free_ranges(p->right, a);
+    a->free(p->lo);
+}
+
+/*
+ * eval_alloc_valid - Check an -A allocator on a trace, like
+ *     eval_mm_valid: payloads must be aligned, must not overlap, and
+ *     must have at least the requested usable size, and realloc must
+ *     keep the contents. Pages are not checked against memlib, whose
+ *     copy in the allocator's object is not ours. Blocks the trace
+ *     leaves allocated are freed at the end.
+ */
+static int eval_alloc_valid(trace_t *trace, int tracenum, const allocator_t *a,
+			    range_t **ranges)
+{
+    long i;
+    int index, size, ok = 0;
+    size_t oldsize, k;
+    trace_cursor_t cur;  /* position in the trace */
+    traceop_t op;        /* the current request */
+    char *p, *newp, *oldp;
+
+    clear_ranges(ranges);
+    if (a->init() < 0) {
+	malloc_error(tracenum, 0, "allocator init failed.");
+	return 0;
+    }
+
+    check_mapped = 0;
+    trace_rewind(trace, &cur);
+    for (i = 0;  i < trace->num_ops && trace_next(trace, &cur, &op);  i++) {
+	index = op.index;
+	size = op.size;
+
+        switch (op.type) {
+
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
-		unix_error("malloc failed in eval_libc_speed");
+	    if ((p = a->malloc(size)) == NULL) {
+		malloc_error(tracenum, i, "malloc failed.");
+		goto out;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		goto out;
+	    if (a->usable_size(p) < (size_t)size) {
+		malloc_error(tracenum, i, "usable_size is less than the request.");
+		goto out;
+	    }
+	    memset(p, index & 0xFF, size);
 	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
 	    break;
 
-	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+        case REALLOC: /* realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = malloc(newsize)) == NULL)
-		unix_error("malloc failed in eval_libc_speed\n");
-            free(oldp);
-	    
+	    oldsize = trace->block_sizes[index];
+	    remove_range(ranges, oldp);
+	    if ((newp = a->realloc(oldp, size)) == NULL) {
+		malloc_error(tracenum, i, "realloc failed.");
+		goto out;
+	    }
+	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+		goto out;
+	    for (k = 0; k < oldsize && k < (size_t)size; k++)
+		if (newp[k] != (char)(index & 0xFF)) {
+		    malloc_error(tracenum, i, "realloc did not preserve the data from old block");
+		    goto out;
+		}
+	    memset(newp, index & 0xFF, size);
 	    trace->blocks[index] = newp;
+	    trace->block_sizes[index] = size;
 	    break;
-	    
+
         case FREE: /* free */
-	    index = trace->ops[i].index;
-	    block = trace->blocks[index];
-	    free(block);
+	    p = trace->blocks[index];
+	    remove_range(ranges, p);
+	    a->free(p);
 	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_alloc_valid");
+        }
+    }
+    ok = 1;
+    free_ranges(*ranges, a);
+    clear_ranges(ranges);
+
+ out:
+    check_mapped = 1;
+    return ok;
+}
+
+/*
+ * The running and peak totals that eval_alloc_util keeps
+ */
+typedef struct {
+    const allocator_t *alloc;
+    size_t total_size, max_total_size, max_heap_size;
+} alloc_util_t;
+
+/*
+ * alloc_util_after - The replay hook of eval_alloc_util: update the
+ *     payload total, and sample the allocator's heap after every request
+ */
+static void alloc_util_after(void *arg, trace_t *trace, const traceop_t *op)
+{
+    alloc_util_t *u = (alloc_util_t *)arg;
+    allocator_stats_t st;
+
+    if (op->type != ALLOC)
+	u->total_size -= trace->block_sizes[op->index];
+    if (op->type != FREE) {
+	u->total_size += op->size;
+	trace->block_sizes[op->index] = op->size;
+    }
+    u->alloc->stats(&st);
+    if (u->total_size > u->max_total_size)
+	u->max_total_size = u->total_size;
+    if (st.heap_bytes > u->max_heap_size)
+	u->max_heap_size = st.heap_bytes;
+}
+
+/*
+ * eval_alloc_util - The peak total payload over the peak heap_bytes
+ *     reported by an -A allocator's stats
+ */
+static double eval_alloc_util(trace_t *trace, int tracenum, const allocator_t *a)
+{
+    alloc_util_t u = { a, 0, 0, 0 };
+    replay_ops_t ops = { a->malloc, a->free, a->realloc, alloc_util_after, &u };
+
+    if (a->init() < 0)
+	app_error("allocator init failed in eval_alloc_util");
+
+    replay(trace, trace->num_ops, &ops, 0, NULL, "eval_alloc_util");
+
+    return u.max_heap_size ? (double)u.max_total_size / u.max_heap_size : 0;
+}
+
+/*
+ * eval_alloc_speed - The function that fsecs times for an -A
+ *     allocator; realloc requests go to its realloc
+ */
+static void eval_alloc_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    const allocator_t *a = ((speed_t *)ptr)->alloc;
+    replay_ops_t ops = { a->malloc, a->free, a->realloc, NULL, NULL };
+
+    if (a->init() < 0)
+	app_error("allocator init failed in eval_alloc_speed");
+
+    replay(trace, trace->num_ops, &ops, 0, NULL, "eval_alloc_speed");
+}
+
+/*
+ * eval_alloc - Check, measure and time an -A allocator on a trace in a
+ *     child process, so that each run starts from the same heap even
+ *     for an allocator that cannot be reset, like glibc's, and one
+ *     that crashes only loses its own results. The child sends its
+ *     stats back through a pipe.
+ */
+static void eval_alloc(trace_t *trace, int tracenum, const allocator_t *a,
+		       range_t **ranges, stats_t *st)
+{
+    int fd[2], status;
+    speed_t params;
+    pid_t pid;
+
+    if (verbose > 1)
+	printf("Checking %s for correctness, efficiency, and performance.\n", a->name);
+    fflush(stdout);
+    if (pipe(fd) < 0)
+	unix_error("pipe failed in eval_alloc");
+    if ((pid = fork()) < 0)
+	unix_error("fork failed in eval_alloc");
+
+    if (pid == 0) {
+	close(fd[0]);
+	memset(st, 0, sizeof(*st));
+	st->ops = trace->num_ops;
+	st->valid = eval_alloc_valid(trace, tracenum, a, ranges);
+	if (st->valid) {
+	    st->util = eval_alloc_util(trace, tracenum, a);
+	    params.trace = trace;
+	    params.ranges = NULL;
+	    params.hist = NULL;
+	    params.alloc = a;
+	    st->secs = fsecs(eval_alloc_speed, &params);
+	    fsecs_interval(&st->secs_lo, &st->secs_hi, &st->outliers);
+	    fsecs_counters(&st->hw);
 	}
+	fflush(stdout);
+	if (write(fd[1], st, sizeof(*st)) != sizeof(*st))
+	    _exit(1);
+	_exit(0);
+    }
+
+    close(fd[1]);
+    if (read(fd[0], st, sizeof(*st)) != sizeof(*st)) {
+	memset(st, 0, sizeof(*st));
+	st->ops = trace->num_ops;
+    }
+    close(fd[0]);
+    if (waitpid(pid, &status, 0) < 0)
+	unix_error("waitpid failed in eval_alloc");
+    if (WIFSIGNALED(status)) {
+	printf("ERROR [trace %d]: %s died with signal %d\n",
+	       tracenum, a->name, WTERMSIG(status));
+	st->valid = 0;
     }
 }
 
@@ -920,6 +2290,108 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * printcompare - prints Kops and util for each -A allocator side by
+ *     side, with the ratios of every allocator after the first to the
+ *     first; stats holds n traces per allocator
+ */
+static void printcompare(int n, stats_t *stats)
+{
+    int i, a;
+    stats_t *st, *st0;
+    double ops[MAX_ALLOCATORS], secs[MAX_ALLOCATORS], util[MAX_ALLOCATORS];
+    int valid[MAX_ALLOCATORS];
+
+    printf("%5s", "");
+    for (a = 0; a < num_allocators; a++)
+	printf(a == 0 ? "%14.14s" : "%28.28s", allocators[a]->name);
+    printf("\n%5s", "trace");
+    for (a = 0; a < num_allocators; a++) {
+	printf("%8s%6s", "Kops", "util");
+	if (a > 0)
+	    printf("%7s%7s", "xKops", "xutil");
+	ops[a] = secs[a] = util[a] = 0;
+	valid[a] = 0;
+    }
+    printf("\n");
+
+    for (i = 0; i < n; i++) {
+	printf("%5d", i);
+	st0 = &stats[i];
+	for (a = 0; a < num_allocators; a++) {
+	    st = &stats[a * n + i];
+	    if (!st->valid) {
+		printf(a == 0 ? "%8s%6s" : "%8s%6s%7s%7s", "-", "-", "-", "-");
+		continue;
+	    }
+	    printf("%8.0f%5.0f%%", (st->ops / 1e3) / st->secs, st->util * 100);
+	    if (a > 0 && st0->valid)
+		printf("%6.2fx%6.2fx", st0->secs / st->secs,
+		       st0->util > 0 ? st->util / st0->util : 0);
+	    else if (a > 0)
+		printf("%7s%7s", "-", "-");
+	    ops[a] += st->ops;
+	    secs[a] += st->secs;
+	    util[a] += st->util;
+	    valid[a]++;
+	}
+	printf("\n");
+    }
+
+    printf("%5s", "Total");
+    for (a = 0; a < num_allocators; a++) {
+	if (valid[a] == 0) {
+	    printf(a == 0 ? "%8s%6s" : "%8s%6s%7s%7s", "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%8.0f%5.0f%%", (ops[a] / 1e3) / secs[a], util[a] / valid[a] * 100);
+	if (a > 0 && valid[0] > 0)
+	    printf("%6.2fx%6.2fx", (ops[a] / secs[a]) / (ops[0] / secs[0]),
+		   util[0] > 0 ? (util[a] / valid[a]) / (util[0] / valid[0]) : 0);
+	else if (a > 0)
+	    printf("%7s%7s", "-", "-");
+    }
+    printf("\n");
+}
+
+/* sum_counter - Add a per-run count to a total; -1 (not counted) sticks */
+static double sum_counter(double total, double count)
+{
+    return total < 0 || count < 0 ? -1 : total + count;
+}
+
+/*
+ * printcounters - prints the -H columns for ops requests, given the
+ *     counts for one run over them
+ */
+static void printcounters(double ops, fsecs_counters_t *hw)
+{
+    if (hw->runs > 0 && hw->cycles > 0 && hw->instructions >= 0)
+	printf("%6.2f", hw->instructions / hw->cycles);
+    else
+	printf("%6s", "-");
+    if (hw->runs > 0 && hw->instructions >= 0)
+	printf("%8.0f", hw->instructions / ops);
+    else
+	printf("%8s", "-");
+    if (hw->runs > 0 && hw->l1d_misses >= 0)
+	printf("%7.2f", hw->l1d_misses / ops);
+    else
+	printf("%7s", "-");
+    if (hw->runs > 0 && hw->llc_misses >= 0)
+	printf("%8.3f", hw->llc_misses / ops);
+    else
+	printf("%8s", "-");
+    if (hw->runs > 0 && hw->dtlb_misses >= 0)
+	printf("%8.3f", hw->dtlb_misses / ops);
+    else
+	printf("%8s", "-");
+    if (hw->runs > 0 && hw->branch_misses >= 0)
+	printf("%7.2f", hw->branch_misses / ops);
+    else
+	printf("%7s", "-");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -930,13 +2402,40 @@ static void printresults(int n, stats_t *stats)
     double ops = 0;
     double util = 0;
     double inst_util = 0;
+    double res_util = 0;
+    int outliers = 0;
+    double scan_avg = 0;
+    double scan_max = 0;
+    double warm_secs = 0;
+    double trim_bytes = 0;
+    double trim_secs = 0;
+    double map_calls = 0, unmap_calls = 0, map_bytes = 0, unmap_bytes = 0;
+    double peak_bytes = 0, map_secs = 0, unmap_secs = 0, sys_max_secs = 0;
+    fsecs_counters_t hw = { 1, 0, 0, 0, 0, 0, 0 };
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%7s%7s%10s%6s\n", 
+    printf("%5s%7s %5s%7s%7s%10s%6s", 
 	   "trace", " valid", "util", "util_i", "ops", "secs", "Kops");
+    if (show_interval)
+	printf("%16s%4s", "Kops 95% CI", "out");
+    if (show_resident)
+	printf("%7s", "util_r");
+    if (show_scan)
+	printf("%8s%8s", "scan", "maxscan");
+    if (warmup_ops > 0)
+	printf("%9s", "warm_us");
+    if (show_trim)
+	printf("%8s%8s", "trimKB", "trim_us");
+    if (show_sys)
+	printf("%7s%7s%9s%9s%8s%9s%9s%7s", "maps", "unmaps", "mapKB",
+	       "unmapKB", "peakKB", "map_us", "unmap_us", "max_us");
+    if (show_counters)
+	printf("%6s%8s%7s%8s%8s%7s", "IPC", "ins/op", "L1/op", "LLC/op",
+	       "TLB/op", "br/op");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
@@ -944,44 +2443,534 @@ static void printresults(int n, stats_t *stats)
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (show_interval)
+		printf("%8.0f-%-7.0f%4d", (stats[i].ops/1e3)/stats[i].secs_hi,
+		       (stats[i].ops/1e3)/stats[i].secs_lo, stats[i].outliers);
+	    if (show_resident)
+		printf("%6.0f%%", stats[i].res_util*100.0);
+	    if (show_scan)
+		printf("%8.1f%8.0f", stats[i].scan_avg, stats[i].scan_max);
+	    if (warmup_ops > 0)
+		printf("%9.1f", stats[i].warm_secs*1e6);
+	    if (show_trim)
+		printf("%8.0f%8.1f", stats[i].trim_bytes/1024, stats[i].trim_secs*1e6);
+	    if (show_sys)
+		printf("%7.0f%7.0f%9.0f%9.0f%8.0f%9.1f%9.1f%7.1f",
+		       stats[i].map_calls, stats[i].unmap_calls,
+		       stats[i].map_bytes/1024, stats[i].unmap_bytes/1024,
+		       stats[i].peak_bytes/1024, stats[i].map_secs*1e6,
+		       stats[i].unmap_secs*1e6, stats[i].sys_max_secs*1e6);
+	    if (show_counters)
+		printcounters(stats[i].ops, &stats[i].hw);
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
 	    inst_util += stats[i].inst_util;
+	    res_util += stats[i].res_util;
+	    outliers += stats[i].outliers;
+	    scan_avg += stats[i].scan_avg;
+	    if (stats[i].scan_max > scan_max)
+		scan_max = stats[i].scan_max;
+	    warm_secs += stats[i].warm_secs;
+	    trim_bytes += stats[i].trim_bytes;
+	    trim_secs += stats[i].trim_secs;
+	    map_calls += stats[i].map_calls;
+	    unmap_calls += stats[i].unmap_calls;
+	    map_bytes += stats[i].map_bytes;
+	    unmap_bytes += stats[i].unmap_bytes;
+	    if (stats[i].peak_bytes > peak_bytes)
+		peak_bytes = stats[i].peak_bytes;
+	    map_secs += stats[i].map_secs;
+	    unmap_secs += stats[i].unmap_secs;
+	    if (stats[i].sys_max_secs > sys_max_secs)
+		sys_max_secs = stats[i].sys_max_secs;
+	    hw.cycles = sum_counter(hw.cycles, stats[i].hw.cycles);
+	    hw.instructions = sum_counter(hw.instructions, stats[i].hw.instructions);
+	    hw.l1d_misses = sum_counter(hw.l1d_misses, stats[i].hw.l1d_misses);
+	    hw.llc_misses = sum_counter(hw.llc_misses, stats[i].hw.llc_misses);
+	    hw.dtlb_misses = sum_counter(hw.dtlb_misses, stats[i].hw.dtlb_misses);
+	    hw.branch_misses = sum_counter(hw.branch_misses, stats[i].hw.branch_misses);
+	    if (stats[i].hw.runs == 0)
+		hw.runs = 0;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
 		   "-");
+	    if (show_interval)
+		printf("%16s%4s", "-", "-");
+	    if (show_resident)
+		printf("%7s", "-");
+	    if (show_scan)
+		printf("%8s%8s", "-", "-");
+	    if (warmup_ops > 0)
+		printf("%9s", "-");
+	    if (show_trim)
+		printf("%8s%8s", "-", "-");
+	    if (show_sys)
+		printf("%7s%7s%9s%9s%8s%9s%9s%7s", "-", "-", "-", "-", "-", "-", "-", "-");
+	    if (show_counters)
+		printf("%6s%8s%7s%8s%8s%7s", "-", "-", "-", "-", "-", "-");
+	    printf("\n");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       (inst_util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (show_interval)
+	    printf("%16s%4d", "", outliers);
+	if (show_resident)
+	    printf("%6.0f%%", (res_util/n)*100.0);
+	if (show_scan)
+	    printf("%8.1f%8.0f", scan_avg/n, scan_max);
+	if (warmup_ops > 0)
+	    printf("%9.1f", warm_secs*1e6);
+	if (show_trim)
+	    printf("%8.0f%8.1f", trim_bytes/1024, trim_secs*1e6);
+	if (show_sys)
+	    printf("%7.0f%7.0f%9.0f%9.0f%8.0f%9.1f%9.1f%7.1f",
+		   map_calls, unmap_calls, map_bytes/1024, unmap_bytes/1024,
+		   peak_bytes/1024, map_secs*1e6, unmap_secs*1e6,
+		   sys_max_secs*1e6);
+	if (show_counters)
+	    printcounters(ops, &hw);
+	printf("\n");
     }
     else {
-	printf("%12s%6s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%6s%8s%10s%6s", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
 	       "-", 
 	       "-");
+	if (show_interval)
+	    printf("%16s%4s", "-", "-");
+	if (show_resident)
+	    printf("%7s", "-");
+	if (show_scan)
+	    printf("%8s%8s", "-", "-");
+	if (warmup_ops > 0)
+	    printf("%9s", "-");
+	if (show_trim)
+	    printf("%8s%8s", "-", "-");
+	if (show_sys)
+	    printf("%7s%7s%9s%9s%8s%9s%9s%7s", "-", "-", "-", "-", "-", "-", "-", "-");
+	if (show_counters)
+	    printf("%6s%8s%7s%8s%8s%7s", "-", "-", "-", "-", "-", "-");
+	printf("\n");
     }
 
 }
 
+/*
+ * printlatency - prints latency percentiles for each request type,
+ *     from hist[3*i + type] for trace i
+ */
+static void printlatency(int n, lathist_t *hist)
+{
+    static const char *names[3] = { "malloc", "free", "realloc" };
+    static const double pcts[4] = { 50, 90, 99, 99.9 };
+    lathist_t total[3];
+    lathist_t *h;
+    int i, t, k;
+
+    printf("%5s %-8s%9s%8s%8s%8s%8s%9s\n",
+	   "trace", "op", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (t = 0; t < 3; t++)
+	lathist_clear(&total[t]);
+    for (i = 0; i <= n; i++) {
+	for (t = 0; t < 3; t++) {
+	    if (i < n) {
+		h = &hist[3 * i + t];
+		lathist_add(&total[t], h);
+	    }
+	    else
+		h = &total[t];
+	    if (h->total == 0)
+		continue;
+	    if (i < n)
+		printf("%5d %-8s%9" PRIu64, i, names[t], h->total);
+	    else
+		printf("%5s %-8s%9" PRIu64, "Total", names[t], h->total);
+	    for (k = 0; k < 4; k++)
+		printf("%8.0f", lathist_percentile(h, pcts[k]));
+	    printf("%9.0f\n", lathist_max(h));
+	}
+    }
+}
+
+/*
+ * set_timer - Parse -m: fcyc, itimer, gettod, or
+ *     sample[:samples[:warmup[:cpu]]]
+ */
+static void set_timer(char *spec)
+{
+    fsecs_sample_t s = { 31, 3, -1 };
+    char *args = strchr(spec, ':');
+    size_t len = args ? (size_t)(args - spec) : strlen(spec);
+
+    if (len == 4 && !strncmp(spec, "fcyc", 4))
+	set_fsecs_timer(FSECS_FCYC);
+    else if (len == 6 && !strncmp(spec, "itimer", 6))
+	set_fsecs_timer(FSECS_ITIMER);
+    else if (len == 6 && !strncmp(spec, "gettod", 6))
+	set_fsecs_timer(FSECS_GETTOD);
+    else if (len == 6 && !strncmp(spec, "sample", 6)) {
+	if (args && sscanf(args + 1, "%d:%d:%d", &s.samples, &s.warmup, &s.cpu) < 1) {
+	    usage();
+	    exit(1);
+	}
+	set_fsecs_timer(FSECS_SAMPLE);
+	set_fsecs_sampling(&s);
+	show_interval = 1;
+	return;
+    }
+    else {
+	usage();
+	exit(1);
+    }
+    show_interval = 0;
+}
+
+/*
+ * parse_size - Parse a byte count with an optional K, M or G suffix
+ */
+static size_t parse_size(char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 'g': case 'G': n <<= 10; /* fall through */
+    case 'm': case 'M': n <<= 10; /* fall through */
+    case 'k': case 'K': n <<= 10; end++; break;
+    }
+    if (end == s || *end != '\0') {
+	usage();
+	exit(1);
+    }
+    return n;
+}
+
+/*
+ * add_mm_conf - Check a key=value option against mm_set_option and
+ *     append it to MM_CONF, which mm_init reads, so it also reaches
+ *     child processes. Later options override earlier ones.
+ */
+static void add_mm_conf(char *opt)
+{
+    char key[MAXLINE];
+    char *eq = strchr(opt, '=');
+    char *old = getenv("MM_CONF");
+    char *conf;
+
+    if (eq == NULL || eq - opt >= MAXLINE) {
+	usage();
+	exit(1);
+    }
+    strncpy(key, opt, eq - opt);
+    key[eq - opt] = '\0';
+    if (mm_set_option(key, eq + 1) < 0) {
+	fprintf(stderr, "Invalid mm option: %s\n", opt);
+	exit(1);
+    }
+
+    if (old == NULL || *old == '\0') {
+	setenv("MM_CONF", opt, 1);
+	return;
+    }
+    if ((conf = malloc(strlen(old) + strlen(opt) + 2)) == NULL)
+	unix_error("malloc failed in add_mm_conf");
+    sprintf(conf, "%s,%s", old, opt);
+    setenv("MM_CONF", conf, 1);
+    free(conf);
+}
+
+/* stat_value - Field f of st as a double */
+static double stat_value(const stats_t *st, const stat_field_t *f)
+{
+    const char *p = (const char *)st + f->offset;
+
+    switch (f->type) {
+    case STAT_INT:
+	return *(const int *)p;
+    case STAT_KOPS:
+	return (st->ops / 1e3) / st->secs;
+    default:
+	return *(const double *)p;
+    }
+}
+
+/* write_string - Print s as a JSON string, or as a CSV field */
+static void write_string(FILE *fp, const char *s, int csv)
+{
+    if (csv && strpbrk(s, ",\"\n") == NULL) {
+	fputs(s, fp);
+	return;
+    }
+    putc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"')
+	    fputs(csv ? "\"\"" : "\\\"", fp);
+	else if (*s == '\\' && !csv)
+	    fputs("\\\\", fp);
+	else
+	    putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/* write_row - One trace's stats as a CSV line or a JSON object */
+static void write_row(FILE *fp, int csv, const char *allocator, int i,
+		      const char *file, const stats_t *st)
+{
+    double v;
+    size_t k;
+
+    if (!csv)
+	fprintf(fp, "    {\"allocator\": ");
+    write_string(fp, allocator, csv);
+    if (csv)
+	fprintf(fp, ",%d,", i);
+    else
+	fprintf(fp, ", \"trace\": %d, \"file\": ", i);
+    write_string(fp, file, csv);
+    for (k = 0; k < NUM_STAT_FIELDS; k++) {
+	v = stat_value(st, &stat_fields[k]);
+	if (!csv)
+	    fprintf(fp, ", \"%s\": ", stat_fields[k].name);
+	else
+	    putc(',', fp);
+	if (!st->valid && k > 0) /* only valid is defined */
+	    fputs(csv ? "" : "null", fp);
+	else if (isfinite(v))
+	    fprintf(fp, "%.9g", v);
+	else
+	    fputs(csv ? "" : "null", fp);
+    }
+    fputs(csv ? "\n" : "}", fp);
+}
+
+/*
+ * write_results - Write every per-trace stat of libc, the -A
+ *     allocators (under their own names) and mm to file (- for
+ *     stdout), as CSV (one row per allocator and trace, after a
+ *     header line) or as JSON. Stats that were not measured
+ *     in this run are 0, or -1 for missing hardware counters; those
+ *     of an invalid trace are empty (CSV) or null (JSON).
+ */
+static void write_results(char *file, int csv, char **tracefiles, int n,
+			  stats_t *libc_stats, stats_t *alloc_stats, stats_t *mm_stats,
+			  double perfindex)
+{
+    FILE *fp = strcmp(file, "-") ? fopen(file, "w") : stdout;
+    int i, a, rows = 0;
+    size_t k;
+
+    if (fp == NULL) {
+	sprintf(msg, "Could not open %.900s in write_results", file);
+	unix_error(msg);
+    }
+
+    if (csv) {
+	fprintf(fp, "allocator,trace,file");
+	for (k = 0; k < NUM_STAT_FIELDS; k++)
+	    fprintf(fp, ",%s", stat_fields[k].name);
+	fprintf(fp, "\n");
+    }
+    else
+	fprintf(fp, "{\n  \"perfindex\": %.9g,\n  \"errors\": %d,\n  \"results\": [\n",
+		perfindex, errors);
+    for (i = 0; libc_stats && i < n; i++, rows++) {
+	if (!csv && rows > 0)
+	    fprintf(fp, ",\n");
+	write_row(fp, csv, "libc", i, tracefiles[i], &libc_stats[i]);
+    }
+    for (a = 0; alloc_stats && a < num_allocators; a++)
+	for (i = 0; i < n; i++, rows++) {
+	    if (!csv && rows > 0)
+		fprintf(fp, ",\n");
+	    write_row(fp, csv, allocators[a]->name, i, tracefiles[i],
+		      &alloc_stats[a * n + i]);
+	}
+    for (i = 0; i < n; i++, rows++) {
+	if (!csv && rows > 0)
+	    fprintf(fp, ",\n");
+	write_row(fp, csv, "mm", i, tracefiles[i], &mm_stats[i]);
+    }
+    if (!csv)
+	fprintf(fp, "\n  ]\n}\n");
+
+    if (fp != stdout && fclose(fp) != 0)
+	unix_error("fclose failed in write_results");
+}
+
+/*
+ * split_csv - Split a line written by write_results into at most max
+ *     fields in place, undoing the quoting. Returns the field count.
+ */
+static int split_csv(char *line, char **fields, int max)
+{
+    char *r = line, *w;
+    int n = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    while (n < max) {
+	fields[n++] = w = r;
+	if (*r == '"') {
+	    for (r++; *r; r++) {
+		if (*r == '"' && r[1] != '"')
+		    break;
+		if (*r == '"')
+		    r++;
+		*w++ = *r;
+	    }
+	    if (*r == '"')
+		r++;
+	}
+	else
+	    while (*r && *r != ',')
+		*w++ = *r++;
+	if (*r != ',') {
+	    *w = '\0';
+	    break;
+	}
+	r++;
+	*w = '\0';
+    }
+    return n;
+}
+
+/*
+ * check_baseline - Compare the mm results with the mm rows of a CSV
+ *     file written by --csv, matching traces by file name. A trace
+ *     regresses if it is no longer valid, its Kops dropped by more
+ *     than kops_tolerance percent, or its util by more than
+ *     util_tolerance points; the same limits apply to the totals of
+ *     the traces found in both. Returns the number of regressions.
+ */
+static int check_baseline(char *file, char **tracefiles, int n, stats_t *mm_stats)
+{
+    char line[4 * MAXLINE];
+    char *fields[NUM_STAT_FIELDS + 3];
+    int col_alloc = -1, col_file = -1, col_valid = -1, col_util = -1;
+    int col_ops = -1, col_secs = -1;
+    int i, k, nf, regressions = 0, matched = 0;
+    double base_ops = 0, base_secs = 0, base_util = 0;
+    double cur_ops = 0, cur_secs = 0, cur_util = 0;
+    double *b_valid, *b_util, *b_kops, kops, bk;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+	sprintf(msg, "Could not open %.900s in check_baseline", file);
+	unix_error(msg);
+    }
+    if (fgets(line, sizeof(line), fp) == NULL)
+	app_error("Empty baseline file");
+    nf = split_csv(line, fields, NUM_STAT_FIELDS + 3);
+    for (k = 0; k < nf; k++) {
+	if (!strcmp(fields[k], "allocator")) col_alloc = k;
+	else if (!strcmp(fields[k], "file")) col_file = k;
+	else if (!strcmp(fields[k], "valid")) col_valid = k;
+	else if (!strcmp(fields[k], "util")) col_util = k;
+	else if (!strcmp(fields[k], "ops")) col_ops = k;
+	else if (!strcmp(fields[k], "secs")) col_secs = k;
+    }
+    if (col_alloc < 0 || col_file < 0 || col_valid < 0 || col_util < 0 ||
+	col_ops < 0 || col_secs < 0)
+	app_error("Baseline file is not mdriver --csv output");
+
+    /* baseline valid, util and Kops for each of our traces; valid < 0 if absent */
+    if ((b_valid = malloc(3 * n * sizeof(double))) == NULL)
+	unix_error("malloc failed in check_baseline");
+    b_util = b_valid + n;
+    b_kops = b_util + n;
+    for (i = 0; i < n; i++)
+	b_valid[i] = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (split_csv(line, fields, NUM_STAT_FIELDS + 3) < nf ||
+	    strcmp(fields[col_alloc], "mm"))
+	    continue;
+	for (i = 0; i < n; i++)
+	    if (!strcmp(fields[col_file], tracefiles[i]) && b_valid[i] < 0) {
+		b_valid[i] = atoi(fields[col_valid]);
+		b_util[i] = atof(fields[col_util]);
+		b_kops[i] = atof(fields[col_ops]) / 1e3 / atof(fields[col_secs]);
+		if (b_valid[i]) {
+		    base_ops += atof(fields[col_ops]);
+		    base_secs += atof(fields[col_secs]);
+		}
+		break;
+	    }
+    }
+    fclose(fp);
+
+    printf("Baseline %s (allowing Kops -%.1f%%, util -%.1f points):\n",
+	   file, kops_tolerance, util_tolerance);
+    printf("%5s %-22s%8s%8s%8s%6s%6s\n",
+	   "trace", "file", "Kops", "base", "change", "util", "base");
+    for (i = 0; i < n; i++) {
+	printf("%5d %-22.22s", i, tracefiles[i]);
+	if (b_valid[i] < 0) {
+	    printf("  not in the baseline\n");
+	    continue;
+	}
+	if (!b_valid[i]) {
+	    printf("  not valid in the baseline\n");
+	    continue;
+	}
+	if (!mm_stats[i].valid) {
+	    printf("  no longer valid  REGRESSION\n");
+	    regressions++;
+	    continue;
+	}
+	matched++;
+	cur_ops += mm_stats[i].ops;
+	cur_secs += mm_stats[i].secs;
+	cur_util += mm_stats[i].util;
+	base_util += b_util[i];
+	kops = (mm_stats[i].ops / 1e3) / mm_stats[i].secs;
+	bk = b_kops[i];
+	printf("%8.0f%8.0f%+7.1f%%%5.0f%%%5.0f%%", kops, bk, (kops / bk - 1) * 100,
+	       mm_stats[i].util * 100, b_util[i] * 100);
+	if (kops < bk * (1 - kops_tolerance / 100) ||
+	    (b_util[i] - mm_stats[i].util) * 100 > util_tolerance) {
+	    printf("  REGRESSION");
+	    regressions++;
+	}
+	printf("\n");
+    }
+    if (matched > 0) {
+	kops = (cur_ops / 1e3) / cur_secs;
+	bk = (base_ops / 1e3) / base_secs;
+	printf("%5s %-22s%8.0f%8.0f%+7.1f%%%5.0f%%%5.0f%%", "Total", "",
+	       kops, bk, (kops / bk - 1) * 100,
+	       cur_util / matched * 100, base_util / matched * 100);
+	if (kops < bk * (1 - kops_tolerance / 100) ||
+	    (base_util - cur_util) / matched * 100 > util_tolerance) {
+	    printf("  REGRESSION");
+	    regressions++;
+	}
+	printf("\n");
+    }
+    printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+    free(b_valid);
+    return regressions;
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1003,10 +2992,10 @@ void unix_error(char *msg)
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-void malloc_error(int tracenum, int opnum, char *msg)
+void malloc_error(int tracenum, long opnum, char *msg)
 {
     errors++;
-    printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+    printf("ERROR [trace %d, line %ld]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
 /* 
@@ -1014,13 +3003,45 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValnspPTMSRzH] [-f <file>] [-t <dir>] [-r <size>] [-w <n>]\n"
+	    "               [-D <seed>[:<pct>[:<free>[:<pages>]]]] [-L <ns>] [-G <size>]\n"
+	    "               [-m <timer>] [-o <key=value>]... [-A <allocator.so>]...\n"
+	    "               [--json <file>] [--csv <file>]\n"
+	    "               [--baseline <file>] [--tolerance <kops>[:<util>]]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-A <lib>   Also run the allocator in shared object <lib> (see\n"
+	    "\t           allocator.h); several are compared side by side.\n");
+    fprintf(stderr, "\t-D <spec>  Scatter decoy mappings around the heap: seed, chance\n"
+	    "\t           per map of a decoy and of a free in percent (50, 25),\n"
+	    "\t           and largest decoy in pages (16).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
+    fprintf(stderr, "\t-G <size>  Map memory in <size> granules (power of two, K/M suffix).\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Print hardware counters (IPC, misses per request).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L <ns>    Add <ns> of latency to every map and unmap.\n");
+    fprintf(stderr, "\t-m <timer> Time with fcyc, itimer, gettod, or sample[:n[:warmup[:cpu]]]:\n"
+	    "\t           the median of n (31) runs after warmup (3) runs, pinned\n"
+	    "\t           to cpu, with a bootstrap 95%% confidence interval.\n");
+    fprintf(stderr, "\t-M         Carve the heap out of one reserved region.\n");
+    fprintf(stderr, "\t-n         Use next-fit instead of first-fit in mm.c.\n");
+    fprintf(stderr, "\t-o <k=v>   Set an mm.c tuning option (see mm_set_option).\n");
+    fprintf(stderr, "\t-p         Prefault the -r reservation.\n");
+    fprintf(stderr, "\t-P         Print per-request latency percentiles.\n");
+    fprintf(stderr, "\t-R         Report utilization against resident memory.\n");
+    fprintf(stderr, "\t-r <size>  Reserve <size> bytes (K/M/G suffix) in mm_init.\n");
+    fprintf(stderr, "\t-s         Print free-list scan statistics.\n");
+    fprintf(stderr, "\t-S         Print memlib map/unmap counts and latencies.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T         Time mm_trim halfway through each trace.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-w <n>     Time the first <n> requests of each trace.\n");
+    fprintf(stderr, "\t-z         Stream traces from disk instead of loading them.\n");
+    fprintf(stderr, "\t--json <file>  Write all per-trace stats as JSON (- for stdout).\n");
+    fprintf(stderr, "\t--csv <file>   Write all per-trace stats as CSV (- for stdout).\n");
+    fprintf(stderr, "\t--baseline <file>  Compare with --csv results; exit 2 on a regression.\n");
+    fprintf(stderr, "\t--tolerance <k>[:<u>]  Allowed drop in Kops, percent (10), and\n"
+	    "\t           in util, points (1), for --baseline.\n");
 }
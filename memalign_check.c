@@ -0,0 +1,143 @@
+/*
+ * memalign_check.c - Randomized check of mm_memalign under several
+ *     block size tunings
+ *
+ *	unix> memalign_check [-n rounds]
+ *
+ * For each pair of min_block_size and split_threshold below, a fresh
+ * heap serves rounds random requests against a table of LIVE slots.
+ * Each round frees a random slot and refills it with mm_memalign (an
+ * alignment of 32 to 4096 bytes and a size of 0 to 300 bytes) or, one
+ * time in four, with plain mm_malloc, so aligned blocks sit among
+ * ordinary ones. Every payload is filled with a byte derived from its
+ * slot and round, and is checked when it is freed and at the end, so a
+ * block that overlaps another or a header written into a payload is
+ * caught. Each result must also be aligned and have at least size
+ * usable bytes. Exits 1 on the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "mm.h"
+#include "memlib.h"
+
+#define LIVE 256
+#define MAX_SIZE 300
+
+typedef struct {
+    unsigned char *p;
+    size_t size;
+    unsigned char fill;
+} slot_t;
+
+static const char *confs[][2] = {
+    { "32", "32" }, { "48", "32" }, { "64", "32" }, { "64", "64" },
+    { "128", "32" }, { "128", "128" }, { "256", "256" },
+};
+
+static uint64_t next_random(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int intact(const slot_t *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->size; i++)
+	if (s->p[i] != s->fill)
+	    return 0;
+    return 1;
+}
+
+static int check(const char *min, const char *split, long rounds)
+{
+    slot_t slot[LIVE];
+    uint64_t seed = 88172645463325252ULL;
+    long r;
+    int k;
+
+    if (mm_set_option("min_block_size", min) < 0 ||
+	mm_set_option("split_threshold", split) < 0) {
+	printf("FAIL: min_block_size=%s split_threshold=%s rejected\n", min, split);
+	return 1;
+    }
+    mem_reset();
+    if (mm_init() < 0) {
+	printf("FAIL: mm_init\n");
+	return 1;
+    }
+    memset(slot, 0, sizeof(slot));
+
+    for (r = 0; r < rounds; r++) {
+	uint64_t x = next_random(&seed);
+	slot_t *s = &slot[x % LIVE];
+	size_t alignment = (size_t)32 << (x >> 8) % 8;
+
+	if (s->p != NULL) {
+	    if (!intact(s)) {
+		printf("FAIL: min_block_size=%s split_threshold=%s: block of %zu "
+		       "overwritten by round %ld\n", min, split, s->size, r);
+		return 1;
+	    }
+	    mm_free(s->p);
+	}
+	s->size = (x >> 16) % (MAX_SIZE + 1);
+	s->fill = (unsigned char)(r | 1);
+	if ((x >> 32) % 4 == 0) {
+	    alignment = 16;
+	    s->p = mm_malloc(s->size);
+	} else
+	    s->p = mm_memalign(alignment, s->size);
+	if (s->p == NULL || (uintptr_t)s->p % alignment ||
+	    mm_usable_size(s->p) < s->size) {
+	    printf("FAIL: min_block_size=%s split_threshold=%s: round %ld, "
+		   "%zu bytes aligned to %zu gave %p\n",
+		   min, split, r, s->size, alignment, (void *)s->p);
+	    return 1;
+	}
+	memset(s->p, s->fill, s->size);
+    }
+
+    for (k = 0; k < LIVE; k++) {
+	if (slot[k].p == NULL)
+	    continue;
+	if (!intact(&slot[k])) {
+	    printf("FAIL: min_block_size=%s split_threshold=%s: block of %zu "
+		   "overwritten\n", min, split, slot[k].size);
+	    return 1;
+	}
+	mm_free(slot[k].p);
+    }
+    printf("min_block_size=%-4s split_threshold=%-4s ok\n", min, split);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = 200000;
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != EOF) {
+	switch (c) {
+	case 'n':
+	    rounds = atol(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-n rounds]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    mem_init();
+    for (i = 0; i < sizeof(confs) / sizeof(confs[0]); i++)
+	if (check(confs[i][0], confs[i][1], rounds))
+	    return 1;
+    return 0;
+}
@@ -1,5 +1,21 @@
 /*
  * memlib.c - bridge to mmap
+ *
+ * Two backends: MEM_BACKEND_MMAP issues one mmap per mem_map, while
+ * MEM_BACKEND_RESERVE reserves one large PROT_NONE region up front,
+ * commits it with mprotect in COMMIT_STEP increments and hands out
+ * sub-ranges of it. There, mem_map is pointer bookkeeping and
+ * mem_unmap is a madvise(MADV_DONTNEED), and the heap is contiguous.
+ *
+ * Both hand out memory in granules: the system page size by default,
+ * or any larger power of two set with mem_set_granule, in which case
+ * every mapping is aligned to a granule boundary. That lets a 4 KiB
+ * machine stand in for 16 KiB, 64 KiB or 2 MiB granularity.
+ *
+ * With mem_set_scatter, the mmap backend also places and frees decoy
+ * mappings next to the heap from a seeded generator, so that growth
+ * and caching policies meet a fragmented address space, and both
+ * backends can add a fixed delay to every call.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +25,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 
 #include "memlib.h"
 #include "pagemap.h"
@@ -16,118 +33,575 @@
 /* private variables */
 static int activity_counter = 0; /* to simulate other processes */
 
-static int page_count;
+static int page_count; /* granules currently mapped */
+
+/* set by mem_init */
+static size_t sys_pagesize;   /* getpagesize() */
+static size_t granule;        /* unit of mem_map, a multiple of sys_pagesize */
+static int log_granule;
+static uintptr_t granule_mask; /* granule - 1 */
+static size_t commit_step;     /* COMMIT_STEP rounded up to a granule */
+static size_t req_granule;     /* from mem_set_granule, 0 for the page size */
+
+static int backend = MEM_BACKEND_MMAP;
+
+static mem_stats_t stats;
+
+/* the reserve backend's region */
+#define RESERVE_SIZE ((size_t)64 << 30) /* address space, not memory */
+#define COMMIT_STEP  ((size_t)4 << 20)
+
+typedef struct extent {
+  char *lo, *hi;
+} extent;
+
+static char *region_base;      /* start of the reservation */
+static char *region_top;       /* end of the ranges handed out so far */
+static char *region_committed; /* end of the read/write part */
+static extent *holes;          /* unmapped ranges below region_top, sorted */
+static int num_holes, max_holes;
+
+/* the scattering simulator */
+static mem_scatter_t scatter;
+static uint64_t rng_state;
+static extent *decoys;          /* live decoy mappings, unordered */
+static int num_decoys, max_decoys;
+static char *last_lo, *last_hi; /* the most recent heap mapping */
+
+static void scatter_step(void);
+static void scatter_reset(void);
+static void delay(void);
+
+static void *region_map(size_t sz);
+static void region_unmap(void *p, size_t sz);
+static void region_reset(void);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-  size_t page_size = (size_t)getpagesize();
-  if (APAGE_SIZE != page_size) {
-    fprintf(stderr, "configuration error: APAGE_SIZE does not match %ld\n",
-            page_size);
+  char *p;
+
+  sys_pagesize = (size_t)getpagesize();
+  if (sys_pagesize % APAGE_SIZE) {
+    fprintf(stderr, "configuration error: page size %ld is not a multiple of "
+            "APAGE_SIZE\n", sys_pagesize);
+    abort();
+  }
+
+  granule = req_granule > sys_pagesize ? req_granule : sys_pagesize;
+  if (granule & (granule - 1)) {
+    fprintf(stderr, "configuration error: granule %ld is not a power of two\n",
+            granule);
+    abort();
+  }
+  log_granule = __builtin_ctzl(granule);
+  granule_mask = granule - 1;
+  commit_step = COMMIT_STEP > granule ? COMMIT_STEP : granule;
+
+  if (backend == MEM_BACKEND_RESERVE && !region_base) {
+    /* reserve a granule extra so that the region can start aligned */
+    p = mmap(0, RESERVE_SIZE + granule, PROT_NONE,
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "mmap of the reserved region failed: %s (%d)\n",
+              strerror(errno), errno);
+      abort();
+    }
+    region_base = (char *)(((uintptr_t)p + granule_mask) & ~granule_mask);
+    region_top = region_committed = region_base;
+  }
+}
+
+/*
+ * mem_set_backend - select MEM_BACKEND_MMAP or MEM_BACKEND_RESERVE;
+ *     call before mem_init
+ */
+void mem_set_backend(int b)
+{
+  if (region_base || page_count) {
+    fprintf(stderr, "mem_set_backend: memory system already in use\n");
     abort();
   }
+  backend = b;
 }
 
-static void unmap(void *p)
+/*
+ * mem_set_granule - hand out memory in units of sz bytes, a power of
+ *     two; sizes at or below the page size mean the page size. Call
+ *     before mem_init.
+ */
+void mem_set_granule(size_t sz)
 {
-  if (munmap(p, APAGE_SIZE) < 0) {
+  if (region_base || page_count) {
+    fprintf(stderr, "mem_set_granule: memory system already in use\n");
+    abort();
+  }
+  req_granule = sz;
+}
+
+static void unmap(void *p, size_t len)
+{
+  if (munmap(p, len) < 0) {
     fprintf(stderr, "unexpected error in munmap: %s (%d)\n",
             strerror(errno), errno);
     abort();
   }
 }
 
+static void forget(void *p, size_t len)
+{
+}
+
+/*
+ * mem_set_scatter - configure the scattering simulator; the decoys
+ *     repeat exactly after every mem_reset
+ */
+void mem_set_scatter(const mem_scatter_t *conf)
+{
+  scatter = *conf;
+  if (scatter.max_decoy_pages == 0)
+    scatter.max_decoy_pages = 1;
+  scatter_reset();
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_reset(void)
 {
-  pagemap_for_each(unmap);
+  if (backend == MEM_BACKEND_RESERVE) {
+    pagemap_for_each_range(forget);
+    region_reset();
+  } else
+    pagemap_for_each_range(unmap);
+  scatter_reset();
   page_count = 0;
   activity_counter = 0;
 }
 
 /*
- * mem_pagesize() - returns the page size of the system
+ * mem_pagesize() - returns the granule, which is the page size of the
+ *     system unless mem_set_granule chose a larger one
  */
 size_t mem_pagesize()
 {
-  return APAGE_SIZE;
+  return granule;
 }
 
 size_t mem_heapsize(void)
 {
-  return APAGE_SIZE * page_count;
+  return (size_t)page_count << log_granule;
+}
+
+static size_t resident_pages;
+
+/* count the resident pages of one mapped range, a batch at a time */
+static void count_resident(void *p, size_t len)
+{
+  unsigned char vec[1024];
+  size_t n, i;
+
+  while (len > 0) {
+    n = len / sys_pagesize;
+    if (n > sizeof(vec))
+      n = sizeof(vec);
+    if (mincore(p, n * sys_pagesize, vec) < 0) {
+      fprintf(stderr, "mincore failed: %s (%d)\n",
+              strerror(errno), errno);
+      abort();
+    }
+    for (i = 0; i < n; i++)
+      resident_pages += vec[i] & 1;
+    p = (char *)p + n * sys_pagesize;
+    len -= n * sys_pagesize;
+  }
+}
+
+/*
+ * mem_resident_size - bytes of the mapped heap that are backed by
+ *     physical memory, which excludes pages never touched or purged
+ */
+size_t mem_resident_size(void)
+{
+  resident_pages = 0;
+  pagemap_visit_ranges(count_resident);
+  return sys_pagesize * resident_pages;
+}
+
+
+/*
+ * mem_stats - copy out the counters; mem_clear_stats - zero them
+ */
+void mem_stats(mem_stats_t *out)
+{
+  *out = stats;
+}
+
+void mem_clear_stats(void)
+{
+  memset(&stats, 0, sizeof(stats));
+  stats.peak_pages = page_count;
+}
+
+/*
+ * map_aligned - mmap sz bytes at a granule boundary, over-mapping by
+ *     a granule less one page and trimming both ends when the granule
+ *     is larger than the page size
+ */
+static void *map_aligned(size_t sz, int mmap_flags)
+{
+  size_t extra = granule - sys_pagesize;
+  char *p, *q;
+
+  p = mmap(0, sz + extra, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "mmap failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+  if (extra == 0)
+    return p;
+
+  q = (char *)(((uintptr_t)p + granule_mask) & ~granule_mask);
+  if (q > p)
+    unmap(p, q - p);
+  if (q + sz < p + sz + extra)
+    unmap(q + sz, p + sz + extra - (q + sz));
+  return q;
 }
 
+/* CLOCK_MONOTONIC is a vDSO call, cheap next to the syscalls it brackets */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
 void *mem_map(size_t sz)
+{
+  return mem_map_flags(sz, 0);
+}
+
+/*
+ * mem_map_flags - mem_map, with MEM_MAP_POPULATE to prefault the pages
+ */
+void *mem_map_flags(size_t sz, int flags)
 {
   void *p;
   size_t i;
+  int mmap_flags = MAP_PRIVATE | MAP_ANON;
+  double start = now(), t;
   
-  if (sz & (APAGE_SIZE - 1)) {
-    fprintf(stderr, "mem_map: requested size is not a multiple of %d: %ld\n",
-            APAGE_SIZE, sz);
+  if (sz & granule_mask) {
+    fprintf(stderr, "mem_map: requested size is not a multiple of %ld: %ld\n",
+            granule, sz);
     abort();
   }
 
-  activity_counter++;
-  if ((activity_counter & (activity_counter - 1)) == 0) {
-    /* allocate a page to ensure that mem_map results are not
-       always sequential */
-    mmap(0, APAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  }
+  delay();
 
-  p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (p == MAP_FAILED) {
-    fprintf(stderr, "mmap failed: %s (%d)\n",
-            strerror(errno), errno);
-    abort();
+  if (backend == MEM_BACKEND_RESERVE) {
+    p = region_map(sz);
+    if (flags & MEM_MAP_POPULATE)
+      for (i = 0; i < sz; i += sys_pagesize)
+        ((volatile char *)p)[i] = 0;
+    goto track;
   }
 
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    pagemap_modify(p + i, 1);
-    page_count++;
+  if (scatter.seed)
+    scatter_step();
+  else {
+    activity_counter++;
+    if ((activity_counter & (activity_counter - 1)) == 0) {
+      /* allocate a page to ensure that mem_map results are not
+         always sequential */
+      mmap(0, sys_pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    }
   }
+
+  if (flags & MEM_MAP_POPULATE)
+    mmap_flags |= MAP_POPULATE;
+
+  p = map_aligned(sz, mmap_flags);
+  last_lo = p;
+  last_hi = (char *)p + sz;
+
+ track:
+  pagemap_set_range(p, sz, 1);
+  page_count += sz >> log_granule;
+
+  stats.map_calls++;
+  stats.map_bytes += sz;
+  if ((size_t)page_count > stats.peak_pages)
+    stats.peak_pages = page_count;
+  t = now() - start;
+  stats.map_secs += t;
+  if (t > stats.map_max_secs)
+    stats.map_max_secs = t;
   
   return p;
 }
 
+/*
+ * mem_purge - drop the contents of mapped pages so the kernel can reclaim
+ *     them; they stay mapped and read back as zero
+ */
+void mem_purge(void *p, size_t sz)
+{
+  if (((uintptr_t)p) & granule_mask) {
+    fprintf(stderr, "mem_purge: given address is not granule-aligned: %p\n",
+            p);
+    abort();
+  }
+
+  if (sz & granule_mask) {
+    fprintf(stderr, "mem_purge: given size is not a multiple of %ld: %ld\n",
+            granule, sz);
+    abort();
+  }
+
+  if (madvise(p, sz, MADV_DONTNEED) < 0) {
+    fprintf(stderr, "madvise failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+}
+
 void mem_unmap(void *p, size_t sz)
 {
-  size_t i;
-  
-  if (((uintptr_t)p) & (APAGE_SIZE - 1)) {
-    fprintf(stderr, "mem_unmap: given address is not page-aligned: %p\n",
+  double start = now(), t;
+
+  if (((uintptr_t)p) & granule_mask) {
+    fprintf(stderr, "mem_unmap: given address is not granule-aligned: %p\n",
             p);
     abort();
   }
 
-  if (sz & (APAGE_SIZE - 1)) {
-    fprintf(stderr, "mem_unmap: given size is not a multiple of %d: %ld\n",
-            APAGE_SIZE, sz);
+  if (sz & granule_mask) {
+    fprintf(stderr, "mem_unmap: given size is not a multiple of %ld: %ld\n",
+            granule, sz);
     abort();
   }
   
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    if (!pagemap_is_mapped(p+i)) {
-      fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
-              p + i, p, p + sz);
+  if (!pagemap_is_range_mapped(p, sz)) {
+    fprintf(stderr, "mem_unmap: given range is not entirely mapped: %p:%p\n",
+            p, p + sz);
+    abort();
+  }
+
+  pagemap_set_range(p, sz, 0);
+  page_count -= sz >> log_granule;
+
+  delay();
+  if (backend == MEM_BACKEND_RESERVE)
+    region_unmap(p, sz);
+  else if (munmap(p, sz) < 0) {
+    fprintf(stderr, "munmap failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+
+  stats.unmap_calls++;
+  stats.unmap_bytes += sz;
+  t = now() - start;
+  stats.unmap_secs += t;
+  if (t > stats.unmap_max_secs)
+    stats.unmap_max_secs = t;
+}
+
+/*
+ * region_map - take sz bytes from the first hole that fits, or else
+ *     from region_top, committing more of the region as needed
+ */
+static void *region_map(size_t sz)
+{
+  char *p;
+  size_t step;
+  int i;
+
+  for (i = 0; i < num_holes; i++) {
+    if ((size_t)(holes[i].hi - holes[i].lo) >= sz) {
+      p = holes[i].lo;
+      holes[i].lo += sz;
+      if (holes[i].lo == holes[i].hi) {
+        memmove(&holes[i], &holes[i+1], (num_holes - i - 1) * sizeof(extent));
+        num_holes--;
+      }
+      return p;
+    }
+  }
+
+  if (sz > (size_t)(region_base + RESERVE_SIZE - region_top)) {
+    fprintf(stderr, "mem_map: reserved region exhausted\n");
+    abort();
+  }
+
+  p = region_top;
+  region_top += sz;
+  if (region_top > region_committed) {
+    step = region_top - region_committed;
+    step = (step + commit_step - 1) & ~(commit_step - 1);
+    if (step > (size_t)(region_base + RESERVE_SIZE - region_committed))
+      step = region_base + RESERVE_SIZE - region_committed;
+    if (mprotect(region_committed, step, PROT_READ | PROT_WRITE) < 0) {
+      fprintf(stderr, "mprotect failed: %s (%d)\n",
+              strerror(errno), errno);
       abort();
-    }      
+    }
+    region_committed += step;
+  }
+  return p;
+}
+
+/*
+ * region_unmap - decommit a range and return it to the sorted hole
+ *     list, merging with its neighbors and with region_top
+ */
+static void region_unmap(void *p, size_t sz)
+{
+  char *lo = p, *hi = lo + sz;
+  int i;
 
-    pagemap_modify(p + i, 0);
-    
-    --page_count;
+  if (madvise(lo, sz, MADV_DONTNEED) < 0) {
+    fprintf(stderr, "madvise failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
   }
 
-  if (munmap(p, sz) < 0) {
-    fprintf(stderr, "munmap failed: %s (%d)\n",
+  for (i = 0; i < num_holes && holes[i].hi < lo; i++)
+    ;
+
+  /* merge into the previous and/or the following hole */
+  if (i < num_holes && holes[i].hi == lo) {
+    holes[i].hi = hi;
+    if (i + 1 < num_holes && holes[i+1].lo == hi) {
+      holes[i].hi = holes[i+1].hi;
+      memmove(&holes[i+1], &holes[i+2], (num_holes - i - 2) * sizeof(extent));
+      num_holes--;
+    }
+  } else if (i < num_holes && holes[i].lo == hi) {
+    holes[i].lo = lo;
+  } else {
+    if (num_holes == max_holes) {
+      max_holes = max_holes ? 2 * max_holes : 16;
+      holes = realloc(holes, max_holes * sizeof(extent));
+      if (!holes) {
+        fprintf(stderr, "mem_unmap: out of memory for holes\n");
+        abort();
+      }
+    }
+    memmove(&holes[i+1], &holes[i], (num_holes - i) * sizeof(extent));
+    holes[i].lo = lo;
+    holes[i].hi = hi;
+    num_holes++;
+  }
+
+  /* a hole at the top just lowers region_top */
+  if (num_holes > 0 && holes[num_holes-1].hi == region_top) {
+    region_top = holes[num_holes-1].lo;
+    num_holes--;
+  }
+}
+
+/*
+ * region_reset - decommit everything handed out; the region stays
+ *     reserved and committed for the next run
+ */
+static void region_reset(void)
+{
+  if (region_top > region_base
+      && madvise(region_base, region_top - region_base, MADV_DONTNEED) < 0) {
+    fprintf(stderr, "madvise failed: %s (%d)\n",
             strerror(errno), errno);
     abort();
   }
+  region_top = region_base;
+  num_holes = 0;
+}
+
+/* xorshift64*, so runs with the same seed see the same address space */
+static uint64_t rng(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * scatter_step - maybe free a random decoy, then maybe map a new one
+ *     just above or just below the latest heap mapping, where the
+ *     heap would otherwise grow
+ */
+static void scatter_step(void)
+{
+  size_t len, gap;
+  char *hint;
+  void *p;
+  int i;
+
+  if (num_decoys > 0 && (int)(rng() % 100) < scatter.free_pct) {
+    i = rng() % num_decoys;
+    unmap(decoys[i].lo, decoys[i].hi - decoys[i].lo);
+    decoys[i] = decoys[--num_decoys];
+  }
+
+  if ((int)(rng() % 100) >= scatter.decoy_pct)
+    return;
+
+  len = (1 + rng() % scatter.max_decoy_pages) * sys_pagesize;
+  gap = (rng() % scatter.max_decoy_pages) * sys_pagesize;
+  if (!last_lo)
+    hint = NULL;
+  else if (rng() & 1)
+    hint = last_hi + gap;
+  else
+    hint = last_lo - gap - len;
+
+  p = mmap(hint, len, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "mmap of a decoy failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+
+  if (num_decoys == max_decoys) {
+    max_decoys = max_decoys ? 2 * max_decoys : 16;
+    decoys = realloc(decoys, max_decoys * sizeof(extent));
+    if (!decoys) {
+      fprintf(stderr, "mem_map: out of memory for decoys\n");
+      abort();
+    }
+  }
+  decoys[num_decoys].lo = p;
+  decoys[num_decoys].hi = (char *)p + len;
+  num_decoys++;
+}
+
+/*
+ * scatter_reset - free every decoy and restart the generator
+ */
+static void scatter_reset(void)
+{
+  while (num_decoys > 0) {
+    num_decoys--;
+    unmap(decoys[num_decoys].lo, decoys[num_decoys].hi - decoys[num_decoys].lo);
+  }
+  rng_state = scatter.seed ? scatter.seed : 1;
+  last_lo = last_hi = NULL;
+}
+
+/* stand in for a contended mmap_sem by spinning for latency_ns */
+static void delay(void)
+{
+  double until;
+
+  if (scatter.latency_ns <= 0)
+    return;
+  until = now() + scatter.latency_ns * 1e-9;
+  while (now() < until)
+    ;
 }
@@ -1,10 +1,49 @@
 #include <unistd.h>
 
 void mem_init(void);               
+void mem_set_backend(int);
+void mem_set_granule(size_t);
 void mem_reset(void);
 
 size_t mem_pagesize(void);
 void *mem_map(size_t);
+void *mem_map_flags(size_t, int);
 void mem_unmap(void *, size_t);
+void mem_purge(void *, size_t);
 
 size_t mem_heapsize(void);
+size_t mem_resident_size(void);
+
+/* kernel traffic since the last mem_clear_stats; mem_reset is not counted */
+typedef struct {
+  size_t map_calls;      /* mem_map and mem_map_flags calls */
+  size_t unmap_calls;    /* mem_unmap calls */
+  size_t map_bytes;      /* bytes handed out by those calls */
+  size_t unmap_bytes;    /* bytes returned by mem_unmap */
+  size_t peak_pages;     /* high-water mark of mapped granules */
+  double map_secs;       /* total time inside mem_map */
+  double map_max_secs;   /* slowest single mem_map */
+  double unmap_secs;     /* total time inside mem_unmap */
+  double unmap_max_secs; /* slowest single mem_unmap */
+} mem_stats_t;
+
+void mem_stats(mem_stats_t *);
+void mem_clear_stats(void);
+
+/* backends for mem_set_backend, called before mem_init */
+#define MEM_BACKEND_MMAP    0 /* one mmap/munmap per mem_map/mem_unmap */
+#define MEM_BACKEND_RESERVE 1 /* sub-ranges of one reserved region */
+
+/* flags for mem_map_flags */
+#define MEM_MAP_POPULATE 0x1 /* prefault the pages (MAP_POPULATE) */
+
+/* address-space scattering, to mimic other users of the address space */
+typedef struct {
+  unsigned seed;          /* 0 keeps the old power-of-two decoy pages */
+  int decoy_pct;          /* chance per mem_map of placing a decoy first */
+  int free_pct;           /* chance per mem_map of freeing a live decoy */
+  size_t max_decoy_pages; /* decoys and the gaps before them are 1..max pages */
+  long latency_ns;        /* busy-wait added to every mem_map and mem_unmap */
+} mem_scatter_t;
+
+void mem_set_scatter(const mem_scatter_t *);
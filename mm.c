@@ -6,9 +6,14 @@
 
   - Implicit list using 8-byte headers/footers
   - Immediate free block coalescing and splitting
-  - Excplicit unordered free list with first-fit
+  - Excplicit unordered free list with first-fit (or next-fit)
   - Doubling mmap size requests, up to a point
+  - Merging a new mapping into the previous chunk when they are adjacent
+  - Optional up-front reservation that is carved up before any mmap
   - Unmap unused pages
+  - Explicit trimming of free chunks and pages with mm_trim
+  - Aligned allocation with mm_memalign, freeing the misaligned front
+  - Runtime tunables via mm_set_option or MM_CONF="key=value,..."
  */
 
 #include <stdio.h>
@@ -32,6 +37,12 @@ typedef struct node{
 // the head of the free list
 free_node* free_list = NULL;
 
+// next-fit: where the last search ended
+free_node* rover = NULL;
+
+// free-list scan telemetry, reset by mm_init
+mm_search_stats search_stats;
+
 int num_page_chunks = 0;
 
 /* always use 16-byte alignment */
@@ -41,7 +52,7 @@ int num_page_chunks = 0;
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 /* rounds up to the nearest multiple of pagesize */
-#define PAGE_ALIGN(size) (((size) + (pagesize-1)) & ~(pagesize-1))
+#define PAGE_ALIGN(size) (((size) + page_mask) & ~page_mask)
 
 
 /*-------------Macros from assignment---*/
@@ -77,35 +88,234 @@ int num_page_chunks = 0;
 #define GET_ALLOC(p) (GET(p) & 0x1)
 #define GET_SIZE(p)  (GET(p) & ~0xF)
 
+// Header bit on a free block whose interior pages were purged by mm_trim.
+// Any rewrite of the header (allocate, coalesce) clears it.
+#define PURGED 0x2
+#define GET_PURGED(p) (GET(p) & PURGED)
+
+/* rounds down to the nearest multiple of pagesize */
+#define PAGE_ALIGN_DOWN(addr) ((addr) & ~page_mask)
+
 #define MAX_PAGE_PER_MAP 32
-  
+
+// Largest max_page_per_map accepted. The multiplier doubles while it is
+// below the cap, so it stays under twice the cap: an int, and at most
+// 2^31 pages once shifted into a size_t.
+#define MAX_PAGE_PER_MAP_LIMIT (1 << 30)
+
+// free-list search policies
+#define MM_FIRST_FIT 0
+#define MM_NEXT_FIT  1
+
+// when mm_free gives an empty page chunk back
+#define UNMAP_NEVER     0
+#define UNMAP_KEEP_LAST 1
+#define UNMAP_ALWAYS    2
+
+// Tunables, set by mm_set_option or the MM_CONF environment variable.
+// The fast paths read them from this one cache line.
+typedef struct {
+  size_t min_block_size;   // smallest block mm_malloc hands out
+  size_t split_threshold;  // smallest remainder worth splitting off
+  int max_page_per_map;    // cap on the doubling in extend, in pages
+  int fit_policy;
+  int unmap_policy;
+} __attribute__((aligned(64))) mm_config;
+
+mm_config conf = {
+  MIN_BLOCK_SIZE,
+  MIN_BLOCK_SIZE,
+  MAX_PAGE_PER_MAP,
+  MM_FIRST_FIT,
+  UNMAP_KEEP_LAST
+};
+
+// MM_CONF is read by the first mm_init only
+int conf_loaded = 0;
+int load_conf(const char* str);
+
 void* extend (size_t size);
+void* place_chunk(void* newmap, size_t newsize);
+void* grow_chunk(void* newmap, size_t newsize);
 void* find_free_block(size_t reqsize);
 void allocate(void* bp, size_t size);
 void* coalesce(void* ptr);
 void add_free(void* bp);
 void del_free(void* bp);
-void try_unmap(void* bp);
+size_t try_unmap(void* bp);
+size_t shrink_chunk(void* bp, size_t keep);
+size_t purge_block(void* bp);
 void print_page(void* page);
 void print_heap(void* start, int N);
 
 int map_multiplier = 1;
+// memlib's granule: the page size, or larger if the driver asks for it
 int pagesize = 0;
+int log_pagesize = 0;
+size_t page_mask = 0;
 void* recent_page;
 
+// base of the mm_reserve chunk, which is never unmapped
+void* reserve_base = NULL;
+
+// end of the most recently placed chunk, or NULL once it is unmapped
+char* heap_end = NULL;
+
+// end of the last chunk's first mapping; the pages grow_chunk added
+// past it can be given back without unmapping the chunk
+char* heap_floor = NULL;
+
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
+  if(!conf_loaded)
+  {
+    if(load_conf(getenv("MM_CONF")) < 0)
+      return -1;
+    conf_loaded = 1;
+  }
+
   map_multiplier = 1;
   free_list = NULL;
+  rover = NULL;
+  reserve_base = NULL;
+  heap_end = NULL;
+  heap_floor = NULL;
   num_page_chunks = 0;
   pagesize = mem_pagesize();
+  log_pagesize = __builtin_ctz(pagesize);
+  page_mask = (size_t)pagesize - 1;
+  memset(&search_stats, 0, sizeof(search_stats));
   
   return 0;
 }
 
+/*
+ * mm_init_with_reserve - mm_init followed by mm_reserve
+ */
+int mm_init_with_reserve(size_t bytes, int flags)
+{
+  if(mm_init() < 0)
+    return -1;
+  return mm_reserve(bytes, flags);
+}
+
+/*
+ * mm_reserve - map one chunk of at least bytes up front, optionally
+ *     prefaulted. Allocations are carved from it before any further
+ *     mem_map, and it stays mapped even when it becomes entirely free.
+ */
+int mm_reserve(size_t bytes, int flags)
+{
+  if(reserve_base != NULL)
+    return -1;
+  // the rounding below would wrap to a tiny reservation
+  if(bytes > (size_t)-1 - PAGE_OVERHEAD - pagesize)
+    return -1;
+
+  size_t size = PAGE_ALIGN(bytes + PAGE_OVERHEAD);
+  void* newmap = mem_map_flags(size, (flags & MM_RESERVE_PREFAULT) ? MEM_MAP_POPULATE : 0);
+  if(newmap == NULL)
+    return -1;
+
+  reserve_base = newmap;
+  place_chunk(newmap, size);
+  return 0;
+}
+
+/*
+ * mm_set_option - set one tunable; returns -1 for an unknown key or a
+ *     bad value. Keys:
+ *       max_page_per_map  cap on the doubling mapping size, in pages,
+ *                         at most 2^30
+ *       min_block_size    smallest block, a multiple of 16 and >= 32
+ *       split_threshold   smallest remainder to split off, same rules
+ *       unmap             never | keep_last | always
+ *       fit               first | next
+ */
+int mm_set_option(const char* key, const char* value)
+{
+  char* end;
+  long n = strtol(value, &end, 0);
+  int numeric = (*value != '\0' && *end == '\0');
+
+  if(strcmp(key, "max_page_per_map") == 0)
+  {
+    if(!numeric || n < 1 || n > MAX_PAGE_PER_MAP_LIMIT)
+      return -1;
+    conf.max_page_per_map = n;
+  }
+  else if(strcmp(key, "min_block_size") == 0 || strcmp(key, "split_threshold") == 0)
+  {
+    if(!numeric || n < (long)MIN_BLOCK_SIZE || n != ALIGN(n))
+      return -1;
+    if(key[0] == 'm')
+      conf.min_block_size = n;
+    else
+      conf.split_threshold = n;
+  }
+  else if(strcmp(key, "unmap") == 0)
+  {
+    if(strcmp(value, "never") == 0)
+      conf.unmap_policy = UNMAP_NEVER;
+    else if(strcmp(value, "keep_last") == 0)
+      conf.unmap_policy = UNMAP_KEEP_LAST;
+    else if(strcmp(value, "always") == 0)
+      conf.unmap_policy = UNMAP_ALWAYS;
+    else
+      return -1;
+  }
+  else if(strcmp(key, "fit") == 0)
+  {
+    if(strcmp(value, "first") == 0)
+      conf.fit_policy = MM_FIRST_FIT;
+    else if(strcmp(value, "next") == 0)
+      conf.fit_policy = MM_NEXT_FIT;
+    else
+      return -1;
+  }
+  else
+    return -1;
+  return 0;
+}
+
+// apply a comma-separated list of key=value options
+int load_conf(const char* str)
+{
+  if(str == NULL)
+    return 0;
+
+  // on the stack: under libmm.so this runs inside the first malloc
+  char copy[strlen(str) + 1];
+  char* save;
+  int result = 0;
+
+  strcpy(copy, str);
+  for(char* opt = strtok_r(copy, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save))
+  {
+    char* eq = strchr(opt, '=');
+    if(eq != NULL)
+      *eq = '\0';
+    if(eq == NULL || mm_set_option(opt, eq + 1) < 0)
+    {
+      fprintf(stderr, "mm_init: bad MM_CONF option: %s\n", opt);
+      result = -1;
+      break;
+    }
+  }
+  return result;
+}
+
+/*
+ * mm_get_search_stats - free-list scan counters since the last mm_init
+ */
+void mm_get_search_stats(mm_search_stats* stats)
+{
+  *stats = search_stats;
+}
+
 /* 
  * mm_malloc - Allocate a block by using bytes from current_avail,
  *     grabbing a new page if necessary.
@@ -113,17 +323,20 @@ int mm_init(void)
 void *mm_malloc(size_t size)
 {
   //printf("malloc %zu\n", size);
-  int newsize = ALIGN(size + OVERHEAD);
+  size_t newsize = ALIGN(size + OVERHEAD);
   void *p;
 
+  if(newsize < conf.min_block_size)
+    newsize = conf.min_block_size;
+
 
   p = find_free_block(newsize);
   if (p == NULL) {
     p = extend(newsize);
     if (p == NULL)
       return NULL;
-    // guaranteed to work if the above extend worked
-    p = find_free_block(newsize);
+    // the new chunk is one free block big enough for the request
+    allocate(p, newsize);
   }
 
   // for debugging
@@ -144,15 +357,137 @@ void mm_free(void *ptr)
   // coalesce will handle updates to the explicit free list  
   void* leftmost = coalesce(ptr);
 
-  // check if we can unmap, but don't unmap the last one
-  if(num_page_chunks > 1)
-    try_unmap(leftmost);
+  // check if we can unmap, by default not the last one
+  size_t released = 0;
+  if(conf.unmap_policy == UNMAP_ALWAYS ||
+     (conf.unmap_policy == UNMAP_KEEP_LAST && num_page_chunks > 1))
+    released = try_unmap(leftmost);
+  // keep what the next extend would map, so that a heap hovering at
+  // its top does not map and unmap on every request
+  if(released == 0 && conf.unmap_policy != UNMAP_NEVER)
+    shrink_chunk(leftmost, (size_t)map_multiplier << log_pagesize);
 
   // for debugging
   //print_heap(recent_page, 30);
 }
 
-void try_unmap(void* bp)
+/*
+ * mm_memalign - mm_malloc with the payload on a multiple of alignment,
+ *     a power of two. Over-allocates, then frees the misaligned front
+ *     as a block of its own and splits off whatever is left at the end.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+  if(alignment <= ALIGNMENT)
+    return mm_malloc(size);
+
+  // room to move the payload far enough for a free block of at least
+  // conf.min_block_size in front, and still leave a whole block at p
+  size_t payload = size;
+  if(payload < conf.min_block_size - OVERHEAD)
+    payload = conf.min_block_size - OVERHEAD;
+  char* bp = mm_malloc(payload + alignment + conf.min_block_size);
+  if(bp == NULL)
+    return NULL;
+
+  size_t total = GET_SIZE(HDRP(bp));
+  char* p = (char*)(((size_t)bp + alignment - 1) & ~(alignment - 1));
+  if(p != bp && (size_t)(p - bp) < conf.min_block_size)
+    p += alignment;
+
+  if(p != bp)
+  {
+    size_t lead = p - bp;
+    total -= lead;
+    PUT(HDRP(bp), PACK(lead, 0));
+    PUT(FTRP(bp), PACK(lead, 0));
+    PUT(HDRP(p), PACK(total, 1));
+    PUT(FTRP(p), PACK(total, 1));
+    coalesce(bp);
+  }
+
+  size_t newsize = ALIGN(size + OVERHEAD);
+  if(newsize < conf.min_block_size)
+    newsize = conf.min_block_size;
+  if(total >= newsize + conf.split_threshold)
+  {
+    PUT(HDRP(p), PACK(newsize, 1));
+    PUT(FTRP(p), PACK(newsize, 1));
+    void* next = NEXT_BLKP(p);
+    PUT(HDRP(next), PACK(total - newsize, 0));
+    PUT(FTRP(next), PACK(total - newsize, 0));
+    coalesce(next);
+  }
+  return p;
+}
+
+/*
+ * mm_usable_size - the payload bytes of an allocated block, which can
+ *     be more than were asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+  return GET_SIZE(HDRP(ptr)) - OVERHEAD;
+}
+
+/*
+ * mm_trim - hand free memory back to the OS. Completely free chunks are
+ *     unmapped (even the last one) and the interior pages of other free
+ *     blocks are purged, retaining at most keep_bytes of free memory.
+ *     Returns the number of bytes released.
+ */
+size_t mm_trim(size_t keep_bytes)
+{
+  size_t kept = 0;
+  size_t released = 0;
+  free_node* n = free_list;
+
+  while(n != NULL)
+  {
+    // n may be unmapped below
+    free_node* next = n->next;
+    size_t size = GET_SIZE(HDRP(n));
+
+    if(kept + size <= keep_bytes)
+      kept += size;
+    else
+    {
+      size_t chunk_bytes = try_unmap(n);
+      if(chunk_bytes > 0)
+        released += chunk_bytes;
+      else
+        released += shrink_chunk(n, 0) + purge_block(n);
+    }
+    n = next;
+  }
+  return released;
+}
+
+/*
+ * purge_block - purge the whole pages inside a free block, keeping the
+ *     page(s) that hold its header, free-list links and footer.
+ *     Returns the number of bytes purged.
+ */
+size_t purge_block(void* bp)
+{
+  if(GET_PURGED(HDRP(bp)))
+    return 0;
+
+  size_t lo = PAGE_ALIGN((size_t)bp + sizeof(free_node));
+  size_t hi = PAGE_ALIGN_DOWN((size_t)FTRP(bp));
+  if(hi <= lo)
+    return 0;
+
+  mem_purge((void*)lo, hi - lo);
+  PUT(HDRP(bp), GET(HDRP(bp)) | PURGED);
+  return hi - lo;
+}
+
+/*
+ * try_unmap - unmap the page chunk if bp is its only block.
+ *     Returns the number of bytes unmapped.
+ */
+size_t try_unmap(void* bp)
 {
   // check if it's a full page chunk surrounded by sentinel and terminator
   void* prev = PREV_BLKP(bp);
@@ -164,10 +499,47 @@ void try_unmap(void* bp)
     size_t chunk_size = GET_SIZE(HDRP(bp)) + PAGE_OVERHEAD;
     // address of page chunk
     void* base = (char*)prev - (sizeof(header) + PAGE_PAD);
-    del_free(bp);
-    mem_unmap(base, chunk_size);
-    num_page_chunks--;
-  }  
+    // the reservation stays mapped
+    if(base != reserve_base)
+    {
+      del_free(bp);
+      mem_unmap(base, chunk_size);
+      num_page_chunks--;
+      if((char*)base + chunk_size == heap_end)
+        heap_end = heap_floor = NULL;
+      return chunk_size;
+    }
+  }
+  return 0;
+}
+
+/*
+ * shrink_chunk - if bp is the free block at the end of the last chunk,
+ *     and the chunk has grown past its first mapping, unmap the whole
+ *     pages of bp that lie beyond that mapping, less keep bytes left
+ *     free, and move the terminator down. Returns the number of bytes
+ *     unmapped.
+ */
+size_t shrink_chunk(void* bp, size_t keep)
+{
+  if(heap_end == NULL || heap_end == heap_floor ||
+     HDRP(NEXT_BLKP(bp)) != heap_end - sizeof(header))
+    return 0;
+
+  // bp keeps at least a minimum block
+  char* new_end = (char*)PAGE_ALIGN((size_t)bp + conf.min_block_size + keep);
+  if(new_end < heap_floor)
+    new_end = heap_floor;
+  if(new_end >= heap_end)
+    return 0;
+
+  size_t released = heap_end - new_end;
+  PUT(HDRP(bp), PACK(new_end - (char*)bp, 0));
+  PUT(FTRP(bp), PACK(new_end - (char*)bp, 0));
+  PUT(new_end - sizeof(header), PACK(sizeof(header), 1));
+  mem_unmap(new_end, released);
+  heap_end = new_end;
+  return released;
 }
 
 void* coalesce(void* ptr)
@@ -248,6 +620,10 @@ void del_free(void* ptr)
   if(node->next != NULL)
     node->next->prev = node->prev;
 
+  // keep the roving pointer on a live node
+  if(node == rover)
+    rover = node->next;
+
   if(node == free_list)
     free_list = free_list->next;
 }
@@ -259,18 +635,47 @@ void del_free(void* ptr)
  */
 void* find_free_block(size_t reqsize)
 {
-  free_node* n = free_list;
+  free_node* start = free_list;
+  size_t visited = 0;
+
+  // next-fit resumes where the last search ended
+  if(conf.fit_policy == MM_NEXT_FIT && rover != NULL)
+    start = rover;
+
+  free_node* n = start;
+  void* found = NULL;
 
   while(n != NULL)
   {
+    visited++;
     if(GET_SIZE(HDRP(n)) >= reqsize)
     {
-      allocate(n, reqsize);      
-      return n;
+      found = n;
+      break;
     }
-    n = n->next;    
+    n = n->next;
+    // wrap around to the head, and stop once we are back at the start
+    if(n == NULL && start != free_list)
+      n = free_list;
+    if(n == start)
+      break;
+  }
+
+  search_stats.searches++;
+  search_stats.nodes_visited += visited;
+  if(visited > search_stats.max_visited)
+    search_stats.max_visited = visited;
+
+  if(found == NULL)
+  {
+    rover = NULL;
+    return NULL;
   }
-  return NULL; 
+
+  // allocate's del_free moves the rover past the chosen node
+  rover = found;
+  allocate(found, reqsize);
+  return found;
 }
 
 
@@ -283,7 +688,7 @@ void allocate(void* bp, size_t size)
   size_t cursize = GET_SIZE(HDRP(bp));
   size_t remainder = cursize - size;
   // split?
-  if(remainder >= MIN_BLOCK_SIZE)
+  if(remainder >= conf.split_threshold)
   {
     // reduce size of current block
     PUT(HDRP(bp), size);
@@ -310,25 +715,58 @@ void allocate(void* bp, size_t size)
 void* extend (size_t size)
 {  
   // The smallest mapping needed for the new allocation
-  int reqsize = PAGE_ALIGN(size + PAGE_OVERHEAD);
+  size_t reqsize = PAGE_ALIGN(size + PAGE_OVERHEAD);
 
   // Try our usual doubling size
-  int newsize = map_multiplier * pagesize;
+  size_t newsize = (size_t)map_multiplier << log_pagesize;
 
   // Take the bigger of the two
   if(newsize < reqsize)
     newsize = reqsize;
 
   // Double the multiplier, to an extent
-  if(map_multiplier < MAX_PAGE_PER_MAP)
+  if(map_multiplier < conf.max_page_per_map)
     map_multiplier *= 2;
 
   void* newmap = mem_map(newsize);
   if(newmap == NULL)
     return NULL;
 
+  // contiguous with the last chunk (always, with a reserved region)?
+  if(newmap == heap_end)
+    return grow_chunk(newmap, newsize);
+
+  return place_chunk(newmap, newsize);
+}
+
+/*
+  Appends a mapping that starts right at heap_end to the last chunk: the
+  old terminator becomes the header of a free block spanning the new
+  pages, which is coalesced with any free block before it.
+ */
+void* grow_chunk(void* newmap, size_t newsize)
+{
+  char* bp = newmap;
+  char* terminator = (char*)newmap + newsize - sizeof(header);
+
+  heap_end = (char*)newmap + newsize;
+
+  PUT(terminator, PACK(sizeof(header), 1));
+  PUT(HDRP(bp), PACK(newsize, 0));
+  PUT(FTRP(bp), PACK(newsize, 0));
+
+  return coalesce(bp);
+}
+
+/*
+  Lays out a freshly mapped page chunk: sentinel, one free block
+  covering the rest, and the terminator. Returns the free block.
+ */
+void* place_chunk(void* newmap, size_t newsize)
+{
   // for debugging only
   recent_page = newmap;
+  heap_end = heap_floor = (char*)newmap + newsize;
 
   num_page_chunks++;
 
@@ -343,7 +781,7 @@ void* extend (size_t size)
   // place the terminator
   PUT(terminator, PACK(sizeof(header), 1));
 
-  int block_size = newsize - PAGE_OVERHEAD;
+  size_t block_size = newsize - PAGE_OVERHEAD;
   // place the unallocated block using the rest of the page
   PUT(HDRP(bp), PACK(block_size, 0));
   PUT(FTRP(bp), PACK(block_size, 0));
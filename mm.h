@@ -1,5 +1,23 @@
 #include <stdio.h>
 
 extern int mm_init (void);
+extern int mm_init_with_reserve (size_t bytes, int flags);
+extern int mm_reserve (size_t bytes, int flags);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void *mm_memalign (size_t alignment, size_t size);
+extern size_t mm_usable_size (void *ptr);
+extern size_t mm_trim (size_t keep_bytes);
+
+/* flags for mm_reserve */
+#define MM_RESERVE_PREFAULT 0x1 /* touch the reserved pages up front */
+
+/* free-list scan telemetry */
+typedef struct {
+  size_t searches;      /* calls to find_free_block */
+  size_t nodes_visited; /* free-list nodes examined over all searches */
+  size_t max_visited;   /* longest single search */
+} mm_search_stats;
+
+extern int mm_set_option (const char *key, const char *value);
+extern void mm_get_search_stats (mm_search_stats *stats);
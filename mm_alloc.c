@@ -0,0 +1,79 @@
+/*
+ * mm_alloc.c - allocator.h adapter for mm.c, built into mm_alloc.so
+ *
+ * The heap comes from this object's own copy of memlib, which init
+ * creates the first time and resets after that. mm.c has no realloc
+ * or calloc, so they are built from mm_malloc and mm_free.
+ */
+#include <string.h>
+#include "mm.h"
+#include "memlib.h"
+#include "allocator.h"
+
+static int mem_ready = 0;
+
+static int mm_alloc_init(void)
+{
+    if (mem_ready)
+	mem_reset();
+    else {
+	mem_init();
+	mem_ready = 1;
+    }
+    return mm_init();
+}
+
+static void *mm_alloc_realloc(void *ptr, size_t size)
+{
+    size_t old;
+    void *newp;
+
+    if (ptr == NULL)
+	return mm_malloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    old = mm_usable_size(ptr);
+    if (size <= old)
+	return ptr;
+    if ((newp = mm_malloc(size)) == NULL)
+	return NULL;
+    memcpy(newp, ptr, old);
+    mm_free(ptr);
+    return newp;
+}
+
+static void *mm_alloc_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > (size_t)-1 / size)
+	return NULL;
+    if ((p = mm_malloc(nmemb * size)) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+static void mm_alloc_stats(allocator_stats_t *stats)
+{
+    stats->heap_bytes = mem_heapsize();
+    stats->allocated_bytes = 0;
+}
+
+static const allocator_t mm_allocator = {
+    ALLOCATOR_ABI_VERSION,
+    "mm_alloc",
+    mm_alloc_init,
+    mm_malloc,
+    mm_free,
+    mm_alloc_realloc,
+    mm_alloc_calloc,
+    mm_usable_size,
+    mm_alloc_stats
+};
+
+ALLOCATOR_EXPORT const allocator_t *allocator_entry(void)
+{
+    return &mm_allocator;
+}
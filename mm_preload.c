@@ -0,0 +1,212 @@
+/*
+ * mm_preload.c - mm.c as the malloc of unmodified programs, built into
+ *     libmm.so:
+ *
+ *	unix> LD_PRELOAD=./libmm.so sort big.txt
+ *
+ * It replaces the whole malloc family that glibc lets a program
+ * interpose, so no pointer from the C library's own heap ever reaches
+ * mm_free. mm.c keeps its heap in globals, so every call that touches
+ * it holds one mutex. The heap is set up by the first call, which may
+ * come from the dynamic loader before any constructor has run; nothing
+ * underneath (memlib, the pagemap, MM_CONF parsing) allocates with
+ * malloc, so that first call cannot recurse. The fork handlers hold the
+ * mutex across fork, so the child never inherits a heap that another
+ * thread was halfway through changing.
+ *
+ * Only the entry points are exported (-fvisibility=hidden); mm.c,
+ * memlib.c and pagemap.c stay private to the library.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* larger requests would wrap around in mm_malloc's size rounding */
+#define MAX_REQUEST ((size_t)PTRDIFF_MAX)
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mm_ready = 0;
+
+/* Take the lock, setting up the heap on the first call */
+static void lock(void)
+{
+    pthread_mutex_lock(&mm_lock);
+    if (!mm_ready) {
+	mem_init();
+	if (mm_init() < 0) {
+	    fprintf(stderr, "libmm.so: mm_init failed\n");
+	    abort();
+	}
+	mm_ready = 1;
+    }
+}
+
+static void unlock(void)
+{
+    pthread_mutex_unlock(&mm_lock);
+}
+
+static void before_fork(void)
+{
+    pthread_mutex_lock(&mm_lock);
+}
+
+static void after_fork(void)
+{
+    pthread_mutex_unlock(&mm_lock);
+}
+
+/* the only thread in the child is the one that forked, and it holds the lock */
+static void after_fork_child(void)
+{
+    pthread_mutex_init(&mm_lock, NULL);
+}
+
+__attribute__((constructor))
+static void mm_preload_init(void)
+{
+    pthread_atfork(before_fork, after_fork, after_fork_child);
+}
+
+static void *locked_malloc(size_t size)
+{
+    void *p;
+
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    lock();
+    p = mm_malloc(size);
+    unlock();
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+/* alignment is a power of two */
+static void *locked_memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST / 2) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    lock();
+    p = mm_memalign(alignment, size);
+    unlock();
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return locked_malloc(size);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    lock();
+    mm_free(ptr);
+    unlock();
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    /* recycled blocks are not zero, so clear them all */
+    if ((p = locked_malloc(nmemb * size)) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    size_t old;
+    void *newp;
+
+    if (ptr == NULL)
+	return locked_malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    old = mm_usable_size(ptr);
+    if (size <= old)
+	return ptr;
+    if ((newp = locked_malloc(size)) == NULL)
+	return NULL;
+    memcpy(newp, ptr, old);
+    free(ptr);
+    return newp;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+	return EINVAL;
+    if ((p = locked_memalign(alignment, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return locked_memalign(alignment, size);
+}
+
+/* like glibc, round an alignment that is not a power of two up to one */
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    size_t a = 1;
+
+    while (a < alignment && a <= MAX_REQUEST / 2)
+	a <<= 1;
+    return locked_memalign(a, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return locked_memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t pagesize = getpagesize();
+
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return locked_memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    /* the header of a live block does not change under its owner */
+    return ptr == NULL ? 0 : mm_usable_size(ptr);
+}
@@ -1,101 +1,425 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #include "pagemap.h"
 
-/* Keep track of all mapped pages so that we can easily get a list of
-   all of them --- but also efficiently add and remove from the list. */
+/* Keep one bit per page. User addresses on x86-64 Linux fit in 47 bits,
+   which after the page offset leaves 12/12/11 bits for a three-level
+   radix tree. A leaf covers the 2048 pages of one 8 MiB region and is
+   allocated the first time one of them is mapped; each thread also
+   remembers the last leaf it looked up, so nearby lookups skip the
+   tree. Each leaf also has a summary bitmap with one bit per nonzero
+   word, so that iteration can skip empty stretches with ctz instead of
+   walking every page. All leaves are chained together so that we can
+   easily visit the mapped pages.
 
-typedef struct mpage {
-  void *addr;
-  struct mpage *prev, *next;
-} mpage;
+   The cache trades scattered lookups for local ones. A hit is two
+   dependent loads (the thread's cache, then the bit word), where a
+   two-level map with 4 GiB leaves needs four. A miss walks all three
+   levels, and a large heap spreads over many small leaves, so lookups
+   at random pages of tens of GiB are slower than with the two-level
+   map (pmchase measures both). The allocator's own lookups stay near
+   the blocks it just touched and hit the cache.
 
-static mpage *all_mapped_pages;
+   The pagemap can be used from several threads at once without a lock:
+   tables and leaves are installed with compare-and-swap (the loser frees
+   its copy), leaves are pushed onto the chain with compare-and-swap and
+   never removed, and bits are set and cleared with atomic fetch-or and
+   fetch-and. A summary bit may briefly be set for an empty word, but is
+   never clear for a nonzero one once the update that set the word has
+   returned. Iteration takes words with an atomic exchange, so pages
+   mapped concurrently are either visited now or left for the next
+   iteration.
 
-static mpage ***page_maps1;
+   Tables, leaves and the walk's scratch array come straight from mmap
+   rather than malloc, so that the pagemap also works underneath a malloc
+   built on memlib (libmm.so) without calling back into it. Leaves are
+   carved from per-thread slabs, so that they share pages instead of
+   each costing a TLB entry of its own. */
 
-#define PAGEMAP64_LEVEL1_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL2_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL3_SIZE (1 << (32 - LOG_APAGE_SIZE))
-#define PAGEMAP64_LEVEL1_BITS(p) (((uintptr_t)(p)) >> 48)
-#define PAGEMAP64_LEVEL2_BITS(p) ((((uintptr_t)(p)) >> 32) & ((PAGEMAP64_LEVEL2_SIZE) - 1))
+#define PAGEMAP_ADDR_BITS 47
+#define PAGEMAP_LEVEL1_LOG 12
+#define PAGEMAP_LEVEL2_LOG 12
+#define PAGEMAP64_LEVEL1_SIZE (1 << PAGEMAP_LEVEL1_LOG)
+#define PAGEMAP64_LEVEL2_SIZE (1 << PAGEMAP_LEVEL2_LOG)
+#define LEAF_SHIFT (PAGEMAP_ADDR_BITS - PAGEMAP_LEVEL1_LOG - PAGEMAP_LEVEL2_LOG)
+#define PAGEMAP64_LEVEL3_SIZE (1 << (LEAF_SHIFT - LOG_APAGE_SIZE))
+#define LEAF_SPAN ((uintptr_t)1 << LEAF_SHIFT)
+#define PAGEMAP64_LEVEL1_BITS(p) (((uintptr_t)(p)) >> (LEAF_SHIFT + PAGEMAP_LEVEL2_LOG))
+#define PAGEMAP64_LEVEL2_BITS(p) ((((uintptr_t)(p)) >> LEAF_SHIFT) & ((PAGEMAP64_LEVEL2_SIZE) - 1))
 #define PAGEMAP64_LEVEL3_BITS(p) ((((uintptr_t)(p)) >> LOG_APAGE_SIZE) & ((PAGEMAP64_LEVEL3_SIZE) - 1))
+#define IN_RANGE(p) ((((uintptr_t)(p)) >> PAGEMAP_ADDR_BITS) == 0)
 
-void pagemap_modify(void *p, int mapped) {
-  uintptr_t pos;
-  mpage **page_maps2;
-  mpage *page_maps3;
-  mpage *page;
+#define LEAF_SLAB_SIZE ((size_t)1 << 20)
+
+#define LEAF_WORDS (PAGEMAP64_LEVEL3_SIZE / 64)
+#define SUMMARY_WORDS ((LEAF_WORDS + 63) / 64)
+
+typedef struct leaf {
+  uint64_t bits[LEAF_WORDS];       /* one bit per page */
+  uint64_t summary[SUMMARY_WORDS]; /* one bit per nonzero word of bits */
+  uintptr_t base;                  /* address of the first page */
+  struct leaf *next;               /* next leaf in all_leaves */
+} leaf;
+
+static leaf ***page_maps1;
+
+static leaf *all_leaves;
+static size_t num_mapped_pages;
+
+/* one-entry cache of the last leaf this thread looked up */
+static __thread struct {
+  uintptr_t key; /* address >> LEAF_SHIFT */
+  leaf *l;
+} last_leaf;
+
+/* this thread's slab of unused leaves, and a leaf that lost a race to
+   be installed and can be handed out again */
+static __thread struct {
+  leaf *next, *end;
+  leaf *spare;
+} leaf_slab;
+
+#define LEAF_PAGE(l, i) ((void *)((l)->base + ((uintptr_t)(i) << LOG_APAGE_SIZE)))
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+static void out_of_memory(void) {
+  fprintf(stderr, "internal error: out of memory for the pagemap\n");
+  abort();
+}
+
+/* zeroed memory from mmap, or NULL */
+static void *map_zeroed(size_t size) {
+  void *t = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return t == MAP_FAILED ? NULL : t;
+}
+
+/* Install a zeroed table of n entries at *slot unless another thread
+   got there first; returns whichever table ends up installed. */
+static void *install(void **slot, size_t n, size_t size) {
+  void *expected = NULL;
+  void *t = map_zeroed(n * size);
+
+  if (!t)
+    out_of_memory();
+  if (__atomic_compare_exchange_n(slot, &expected, t, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return t;
+  munmap(t, n * size);
+  return expected;
+}
+
+/* a zeroed leaf from this thread's slab, which is refilled from mmap */
+static leaf *alloc_leaf(void) {
+  leaf *l = leaf_slab.spare;
+
+  if (l) {
+    leaf_slab.spare = NULL;
+    return l;
+  }
+  if (leaf_slab.next == leaf_slab.end) {
+    leaf_slab.next = map_zeroed(LEAF_SLAB_SIZE);
+    if (!leaf_slab.next)
+      out_of_memory();
+    leaf_slab.end = leaf_slab.next + LEAF_SLAB_SIZE / sizeof(leaf);
+  }
+  return leaf_slab.next++;
+}
+
+static leaf *find_leaf(void *p) {
+  uintptr_t key = ((uintptr_t)p) >> LEAF_SHIFT;
+  leaf ***maps1;
+  leaf **page_maps2;
+  leaf *l;
+
+  if (last_leaf.l && last_leaf.key == key)
+    return last_leaf.l;
 
-  if (!page_maps1) {
-    page_maps1 = calloc(PAGEMAP64_LEVEL1_SIZE, sizeof(mpage **));
+  maps1 = LOAD(&page_maps1);
+  if (!maps1 || !IN_RANGE(p)) return NULL;
+  page_maps2 = LOAD(&maps1[PAGEMAP64_LEVEL1_BITS(p)]);
+  if (!page_maps2) return NULL;
+  l = LOAD(&page_maps2[PAGEMAP64_LEVEL2_BITS(p)]);
+  if (l) {
+    /* leaves are never freed, so the cache cannot go stale */
+    last_leaf.key = key;
+    last_leaf.l = l;
   }
+  return l;
+}
+
+static leaf *make_leaf(void *p) {
+  leaf ***maps1;
+  leaf **page_maps2, **slot;
+  leaf *l, *expected, *head;
 
-  pos = PAGEMAP64_LEVEL1_BITS(p);
-  page_maps2 = page_maps1[pos];
-  if (!page_maps2) {
-    page_maps2 = calloc(PAGEMAP64_LEVEL2_SIZE, sizeof(mpage *));
-    page_maps1[pos] = page_maps2;
+  l = find_leaf(p);
+  if (l)
+    return l;
+
+  if (!IN_RANGE(p)) {
+    fprintf(stderr, "internal error: address beyond %d bits: %p\n",
+            PAGEMAP_ADDR_BITS, p);
+    abort();
   }
-  
-  pos = PAGEMAP64_LEVEL2_BITS(p);
-  page_maps3 = page_maps2[pos];
-  if (!page_maps3) {
-    page_maps3 = calloc(PAGEMAP64_LEVEL3_SIZE, sizeof(mpage));
-    page_maps2[pos] = page_maps3;
+
+  maps1 = LOAD(&page_maps1);
+  if (!maps1)
+    maps1 = install((void **)&page_maps1, PAGEMAP64_LEVEL1_SIZE, sizeof(leaf **));
+
+  page_maps2 = LOAD(&maps1[PAGEMAP64_LEVEL1_BITS(p)]);
+  if (!page_maps2)
+    page_maps2 = install((void **)&maps1[PAGEMAP64_LEVEL1_BITS(p)],
+                         PAGEMAP64_LEVEL2_SIZE, sizeof(leaf *));
+
+  slot = &page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
+  l = LOAD(slot);
+  if (l)
+    return l;
+
+  l = alloc_leaf();
+  l->base = ((uintptr_t)p) & ~(LEAF_SPAN - 1);
+
+  expected = NULL;
+  if (!__atomic_compare_exchange_n(slot, &expected, l, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    /* never published, so still zero apart from base */
+    leaf_slab.spare = l;
+    return expected;
   }
 
-  page = &page_maps3[PAGEMAP64_LEVEL3_BITS(p)];
+  /* only the winner links the leaf into the chain */
+  head = LOAD(&all_leaves);
+  do {
+    l->next = head;
+  } while (!__atomic_compare_exchange_n(&all_leaves, &head, l, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  return l;
+}
+
+/* Set or clear the bits in mask of word i>>6 of a leaf; n is the number
+   of bits in mask. Aborts if any of them is already in that state. */
+static void update_word(leaf *l, uintptr_t i, uint64_t mask, size_t n, int mapped) {
+  uint64_t *word = &l->bits[i >> 6];
+  uint64_t *sum = &l->summary[i >> 12];
+  uint64_t sum_bit = (uint64_t)1 << ((i >> 6) & 63);
+  uint64_t old;
 
   if (mapped) {
-    if (page->addr) {
+    old = __atomic_fetch_or(word, mask, __ATOMIC_SEQ_CST);
+    if (old & mask) {
       fprintf(stderr, "internal error: page is already mapped\n");
       abort();
     }
-    if (page == all_mapped_pages)
-      abort();
-    page->addr = p;
-    page->prev = NULL;
-    page->next = all_mapped_pages;
-    if (all_mapped_pages)
-      all_mapped_pages->prev = page;
-    all_mapped_pages = page;
+    if (!(__atomic_load_n(sum, __ATOMIC_SEQ_CST) & sum_bit))
+      __atomic_fetch_or(sum, sum_bit, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&num_mapped_pages, n, __ATOMIC_RELAXED);
   } else {
-    if (!page->addr) {
+    old = __atomic_fetch_and(word, ~mask, __ATOMIC_SEQ_CST);
+    if ((old & mask) != mask) {
       fprintf(stderr, "internal error: not currently mapped\n");
       abort();
     }
-    page->addr = NULL;
-    if (page->prev)
-      page->prev->next = page->next;
-    else
-      all_mapped_pages = page->next;
-    if (page->next)
-      page->next->prev = page->prev;
+    if (!(old & ~mask)) {
+      /* the word went empty: clear its summary bit, then put it back
+         if another thread set a bit in the meantime */
+      __atomic_fetch_and(sum, ~sum_bit, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(word, __ATOMIC_SEQ_CST))
+        __atomic_fetch_or(sum, sum_bit, __ATOMIC_SEQ_CST);
+    }
+    __atomic_fetch_sub(&num_mapped_pages, n, __ATOMIC_RELAXED);
   }
 }
 
+void pagemap_modify(void *p, int mapped) {
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
+
+  update_word(make_leaf(p), i, (uint64_t)1 << (i & 63), 1, mapped);
+}
+
 int pagemap_is_mapped(void *p) {
-  mpage **page_maps2;
-  mpage *page_maps3;
+  leaf *l = find_leaf(p);
+  uintptr_t i;
 
-  if (!page_maps1) return 0;
-  page_maps2 = page_maps1[PAGEMAP64_LEVEL1_BITS(p)];
-  if (!page_maps2) return 0;
-  page_maps3 = page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
-  if (!page_maps3) return 0;
-  return !!page_maps3[PAGEMAP64_LEVEL3_BITS(p)].addr;
+  if (!l) return 0;
+  i = PAGEMAP64_LEVEL3_BITS(p);
+  return (LOAD(&l->bits[i >> 6]) >> (i & 63)) & 1;
+}
+
+/* Pages from p to end within the same 64-page word, and the word's
+   mask for them */
+static size_t word_span(uintptr_t p, uintptr_t end, uint64_t *mask) {
+  unsigned shift = PAGEMAP64_LEVEL3_BITS(p) & 63;
+  size_t n = 64 - shift;
+  size_t left = (end - p + APAGE_SIZE - 1) >> LOG_APAGE_SIZE;
+
+  if (left < n)
+    n = left;
+  *mask = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << shift;
+  return n;
+}
+
+/* Is every page that overlaps [lo, lo+len) mapped? Checks up to 64
+   pages per word access. */
+int pagemap_is_range_mapped(void *lo, size_t len) {
+  uintptr_t p = ((uintptr_t)lo) & ~(uintptr_t)(APAGE_SIZE - 1);
+  uintptr_t end = (uintptr_t)lo + len;
+  leaf *l = NULL;
+  uint64_t mask;
+  size_t n;
+
+  while (p < end) {
+    if (!l || p - l->base >= LEAF_SPAN) {
+      l = find_leaf((void *)p);
+      if (!l) return 0;
+    }
+    n = word_span(p, end, &mask);
+    if ((LOAD(&l->bits[PAGEMAP64_LEVEL3_BITS(p) >> 6]) & mask) != mask)
+      return 0;
+    p += n << LOG_APAGE_SIZE;
+  }
+  return 1;
+}
+
+/* Mark the pages in [lo, lo+len) as mapped or unmapped, a word at a
+   time; lo and len must be page-aligned. */
+void pagemap_set_range(void *lo, size_t len, int mapped) {
+  uintptr_t p = (uintptr_t)lo, end = p + len;
+  leaf *l = NULL;
+  uint64_t mask;
+  size_t n;
+
+  while (p < end) {
+    if (!l || p - l->base >= LEAF_SPAN)
+      l = make_leaf((void *)p);
+    n = word_span(p, end, &mask);
+    update_word(l, PAGEMAP64_LEVEL3_BITS(p), mask, n, mapped);
+    p += n << LOG_APAGE_SIZE;
+  }
+}
+
+/* Take the summary word s of a leaf, leaving it empty */
+static uint64_t take_summary(leaf *l, size_t s) {
+  if (!__atomic_load_n(&l->summary[s], __ATOMIC_RELAXED))
+    return 0;
+  return __atomic_exchange_n(&l->summary[s], 0, __ATOMIC_SEQ_CST);
+}
+
+/* Take the bits of word w of a leaf, leaving it empty */
+static uint64_t take_word(leaf *l, size_t w) {
+  uint64_t bits = __atomic_exchange_n(&l->bits[w], 0, __ATOMIC_SEQ_CST);
+
+  __atomic_fetch_sub(&num_mapped_pages, __builtin_popcountll(bits), __ATOMIC_RELAXED);
+  return bits;
+}
+
+/* The number of pages currently marked as mapped */
+size_t pagemap_num_mapped(void) {
+  return LOAD(&num_mapped_pages);
 }
 
 void pagemap_for_each(page_callback f) {
-  mpage *p, *next;
-  p = all_mapped_pages;
-  while (p) {
-    next = p->next;
-    f(p->addr);
-    pagemap_modify(p->addr, 0);
-    p = next;
+  leaf *l;
+  size_t s, w;
+
+  for (l = LOAD(&all_leaves); l; l = l->next) {
+    for (s = 0; s < SUMMARY_WORDS; s++) {
+      uint64_t sum = take_summary(l, s);
+      while (sum) {
+        w = s * 64 + __builtin_ctzll(sum);
+        uint64_t bits = take_word(l, w);
+        while (bits) {
+          f(LEAF_PAGE(l, w * 64 + __builtin_ctzll(bits)));
+          bits &= bits - 1;
+        }
+        sum &= sum - 1;
+      }
+    }
   }
-  all_mapped_pages = NULL;
+}
+
+static int compare_leaves(const void *a, const void *b) {
+  uintptr_t x = (*(leaf **)a)->base, y = (*(leaf **)b)->base;
+  return (x > y) - (x < y);
+}
+
+/* Read word w of a leaf; with take, also clear it and its count */
+static uint64_t read_word(leaf *l, size_t w, int take) {
+  return take ? take_word(l, w) : LOAD(&l->bits[w]);
+}
+
+/* Call f once for each maximal run of contiguous mapped pages, in
+   address order. With take, the pages are unregistered in bulk as
+   they are visited. */
+static void walk_ranges(range_callback f, int take) {
+  leaf **leaves, *l, *head;
+  size_t n = 0, i, s, w;
+  char *run = NULL, *run_end = NULL;
+
+  if (!LOAD(&num_mapped_pages))
+    return;
+
+  /* leaves added after this snapshot are left for the next call */
+  head = LOAD(&all_leaves);
+  for (l = head; l; l = l->next)
+    n++;
+  leaves = map_zeroed(n * sizeof(leaf *));
+  if (!leaves) {
+    fprintf(stderr, "internal error: out of memory in the pagemap range walk\n");
+    abort();
+  }
+  for (i = 0, l = head; l; l = l->next)
+    leaves[i++] = l;
+  qsort(leaves, n, sizeof(leaf *), compare_leaves);
+
+  for (i = 0; i < n; i++) {
+    l = leaves[i];
+    for (s = 0; s < SUMMARY_WORDS; s++) {
+      uint64_t sum = take ? take_summary(l, s) : LOAD(&l->summary[s]);
+      while (sum) {
+        w = s * 64 + __builtin_ctzll(sum);
+        uint64_t bits = read_word(l, w, take);
+        while (bits) {
+          /* the next run of set bits within this word */
+          int lo = __builtin_ctzll(bits);
+          uint64_t rest = ~(bits >> lo);
+          int len = rest ? __builtin_ctzll(rest) : 64;
+          char *p = LEAF_PAGE(l, w * 64 + lo);
+
+          if (lo + len == 64)
+            bits = 0;
+          else
+            bits &= ~((((uint64_t)1 << len) - 1) << lo);
+
+          if (p != run_end) {
+            if (run)
+              f(run, run_end - run);
+            run = p;
+          }
+          run_end = p + ((size_t)len << LOG_APAGE_SIZE);
+        }
+        sum &= sum - 1;
+      }
+    }
+  }
+  if (run)
+    f(run, run_end - run);
+
+  munmap(leaves, n * sizeof(leaf *));
+}
+
+/* Like pagemap_for_each, but calls f once for each maximal run of
+   contiguous mapped pages, in address order, and unregisters all
+   pages in bulk. */
+void pagemap_for_each_range(range_callback f) {
+  walk_ranges(f, 1);
+}
+
+/* Like pagemap_for_each_range, but leaves the pages registered. */
+void pagemap_visit_ranges(range_callback f) {
+  walk_ranges(f, 0);
 }
@@ -1,10 +1,17 @@
 
 typedef void (*page_callback)(void *addr);
+typedef void (*range_callback)(void *addr, size_t len);
 
 void pagemap_modify(void *addr, int mapped);
 int pagemap_is_mapped(void *addr);
+int pagemap_is_range_mapped(void *lo, size_t len);
+void pagemap_set_range(void *lo, size_t len, int mapped);
+size_t pagemap_num_mapped(void);
 void pagemap_for_each(page_callback f);
+void pagemap_for_each_range(range_callback f);
+void pagemap_visit_ranges(range_callback f);
 
-/* APAGE_SIZE needs to match the actual page size */
+/* APAGE_SIZE is the unit the pagemap tracks; the page size and the
+   memlib granule must be multiples of it */
 #define LOG_APAGE_SIZE 12
 #define APAGE_SIZE (1 << LOG_APAGE_SIZE)
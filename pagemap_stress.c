@@ -0,0 +1,326 @@
+/*
+ * pagemap_stress.c - Concurrency stress test and benchmark for the
+ *     pagemap
+ *
+ *	unix> pagemap_stress [-t threads] [-n rounds]
+ *	unix> pagemap_stress -b [-t max threads] [-n rounds] [-l pages]
+ *
+ * The pagemap only keeps bits, so the threads mark address ranges that
+ * were never mapped. Each thread owns SLICE_PAGES pages and keeps a
+ * private shadow bitmap of them. In stress mode the pages are dealt out
+ * in blocks of BLOCK, so the threads' ranges are disjoint but share
+ * bitmap words, and some blocks straddle two leaves; in benchmark mode
+ * each thread's pages are contiguous.
+ *
+ * Stress mode: every round picks a random range within one block. A
+ * range that is entirely clear is mapped with pagemap_set_range, an
+ * entirely set one is unmapped, and a mixed one is toggled a page at a
+ * time with pagemap_modify. Meanwhile another thread walks the ranges
+ * with pagemap_visit_ranges and checks that each lies among the blocks.
+ * When the threads are done, every page must agree with the shadows,
+ * and pagemap_num_mapped must equal the shadow count, as must the
+ * number of pages the walk visits. A final pagemap_for_each_range
+ * takes every page and must leave the count at zero. Exits 1 on any
+ * mismatch; the pagemap itself aborts on a double map or unmap.
+ *
+ * Benchmark mode (-b): for 1, 2, 4, ... up to the given number of
+ * threads, each thread maps and unmaps a run of -l pages (default 16)
+ * at a new spot in its slice, rounds times, and the aggregate rate is
+ * printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "pagemap.h"
+
+#define MAX_THREADS 64
+#define SLICE_PAGES ((uintptr_t)1 << 20)  /* 4 GiB of 4 KiB pages */
+#define BASE ((uintptr_t)1 << 45)         /* well inside the 47 bits */
+#define BLOCK 40                          /* not a divisor of 64 or 2048 */
+
+typedef struct {
+    int id;
+    long rounds;
+    size_t run;             /* pages per run (-b) */
+    uint64_t seed;
+    uint64_t *shadow;       /* one bit per page of the slice */
+    size_t mapped;          /* pages set in shadow */
+} worker_t;
+
+static int num_threads = 8;
+static int stop_walker = 0;
+static size_t walk_bad = 0;
+
+static uint64_t next_random(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* page of thread id's contiguous slice (-b) */
+static char *page_addr(int id, uintptr_t page)
+{
+    return (char *)(BASE + ((id * SLICE_PAGES + page) << LOG_APAGE_SIZE));
+}
+
+/* page of thread id's share of the interleaved blocks */
+static char *block_addr(int id, uintptr_t page)
+{
+    uintptr_t g = ((page / BLOCK) * num_threads + id) * BLOCK + page % BLOCK;
+
+    return (char *)(BASE + (g << LOG_APAGE_SIZE));
+}
+
+static int shadow_get(worker_t *w, uintptr_t page)
+{
+    return (w->shadow[page >> 6] >> (page & 63)) & 1;
+}
+
+static void shadow_flip(worker_t *w, uintptr_t page)
+{
+    w->shadow[page >> 6] ^= (uint64_t)1 << (page & 63);
+}
+
+static void *stress_thread(void *arg)
+{
+    worker_t *w = arg;
+    long r;
+
+    for (r = 0; r < w->rounds; r++) {
+	uint64_t x = next_random(&w->seed);
+	uintptr_t off = x % BLOCK;
+	size_t len = 1 + (x >> 8) % (BLOCK - off);
+	uintptr_t lo = (x >> 24) % (SLICE_PAGES / BLOCK) * BLOCK + off;
+	size_t set = 0, i;
+
+	for (i = 0; i < len; i++)
+	    set += shadow_get(w, lo + i);
+
+	if (set == 0 || set == len) {
+	    pagemap_set_range(block_addr(w->id, lo), len << LOG_APAGE_SIZE, set == 0);
+	    for (i = 0; i < len; i++)
+		shadow_flip(w, lo + i);
+	    if (set == 0)
+		w->mapped += len;
+	    else
+		w->mapped -= len;
+	    if (pagemap_is_range_mapped(block_addr(w->id, lo), len << LOG_APAGE_SIZE)
+		!= (set == 0)) {
+		fprintf(stderr, "thread %d: range check failed after round %ld\n",
+			w->id, r);
+		exit(1);
+	    }
+	} else {
+	    for (i = 0; i < len; i++) {
+		int was = shadow_get(w, lo + i);
+
+		pagemap_modify(block_addr(w->id, lo + i), !was);
+		shadow_flip(w, lo + i);
+		if (was)
+		    w->mapped--;
+		else
+		    w->mapped++;
+	    }
+	}
+
+	/* a random page of the slice must agree with the shadow */
+	i = next_random(&w->seed) % SLICE_PAGES;
+	if (pagemap_is_mapped(block_addr(w->id, i)) != shadow_get(w, i)) {
+	    fprintf(stderr, "thread %d: page %zu disagrees after round %ld\n",
+		    w->id, (size_t)i, r);
+	    exit(1);
+	}
+    }
+    return NULL;
+}
+
+static size_t walked;
+
+static void check_range(void *addr, size_t len)
+{
+    uintptr_t p = (uintptr_t)addr;
+    uintptr_t top = BASE + ((num_threads * SLICE_PAGES) << LOG_APAGE_SIZE);
+
+    if (p < BASE || p + len > top || len % APAGE_SIZE)
+	walk_bad++;
+    walked += len >> LOG_APAGE_SIZE;
+}
+
+static void *walker_thread(void *arg)
+{
+    long *walks = arg;
+
+    while (!__atomic_load_n(&stop_walker, __ATOMIC_ACQUIRE)) {
+	pagemap_visit_ranges(check_range);
+	(*walks)++;
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int stress(long rounds)
+{
+    worker_t w[MAX_THREADS];
+    pthread_t tid[MAX_THREADS], walker;
+    size_t expected = 0, i, bad = 0;
+    long walks = 0;
+    int t;
+
+    for (t = 0; t < num_threads; t++) {
+	w[t].id = t;
+	w[t].rounds = rounds;
+	w[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+	w[t].mapped = 0;
+	if ((w[t].shadow = calloc(SLICE_PAGES / 64, sizeof(uint64_t))) == NULL) {
+	    fprintf(stderr, "out of memory\n");
+	    exit(1);
+	}
+    }
+    pthread_create(&walker, NULL, walker_thread, &walks);
+    for (t = 0; t < num_threads; t++)
+	pthread_create(&tid[t], NULL, stress_thread, &w[t]);
+    for (t = 0; t < num_threads; t++)
+	pthread_join(tid[t], NULL);
+    __atomic_store_n(&stop_walker, 1, __ATOMIC_RELEASE);
+    pthread_join(walker, NULL);
+
+    for (t = 0; t < num_threads; t++) {
+	expected += w[t].mapped;
+	for (i = 0; i < SLICE_PAGES; i++)
+	    if (pagemap_is_mapped(block_addr(t, i)) != shadow_get(&w[t], i))
+		bad++;
+    }
+    printf("%d threads x %ld rounds, %ld concurrent walks: %zu pages mapped\n",
+	   num_threads, rounds, walks, expected);
+    if (walk_bad) {
+	printf("FAIL: a concurrent walk saw %zu ranges outside the slices\n", walk_bad);
+	return 1;
+    }
+    if (bad) {
+	printf("FAIL: %zu pages disagree with the shadow bitmaps\n", bad);
+	return 1;
+    }
+    if (pagemap_num_mapped() != expected) {
+	printf("FAIL: pagemap_num_mapped is %zu, expected %zu\n",
+	       pagemap_num_mapped(), expected);
+	return 1;
+    }
+    walked = 0;
+    pagemap_visit_ranges(check_range);
+    if (walked != expected) {
+	printf("FAIL: pagemap_visit_ranges visited %zu pages, expected %zu\n",
+	       walked, expected);
+	return 1;
+    }
+    walked = 0;
+    pagemap_for_each_range(check_range);
+    if (walked != expected || pagemap_num_mapped() != 0) {
+	printf("FAIL: pagemap_for_each_range took %zu pages and left %zu\n",
+	       walked, pagemap_num_mapped());
+	return 1;
+    }
+    for (t = 0; t < num_threads; t++)
+	free(w[t].shadow);
+    printf("ok\n");
+    return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+    worker_t *w = arg;
+    size_t bytes = w->run << LOG_APAGE_SIZE;
+    uintptr_t spots = SLICE_PAGES / w->run, s = 0;
+    long r;
+
+    for (r = 0; r < w->rounds; r++) {
+	char *p = page_addr(w->id, s * w->run);
+
+	pagemap_set_range(p, bytes, 1);
+	pagemap_set_range(p, bytes, 0);
+	/* move on by 97 runs, so each round lands on a fresh spot */
+	s = (s + 97) % spots;
+    }
+    return NULL;
+}
+
+static int bench(long rounds, size_t run)
+{
+    worker_t w[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int n, t;
+
+    printf("%d-page runs, %ld map+unmap pairs per thread\n", (int)run, rounds);
+    printf("threads  Mpairs/s  ns/pair\n");
+    for (n = 1; ; n *= 2) {
+	double start, secs;
+
+	if (n > num_threads)
+	    n = num_threads;
+	for (t = 0; t < n; t++) {
+	    w[t].id = t;
+	    w[t].rounds = rounds;
+	    w[t].run = run;
+	}
+	start = now();
+	for (t = 0; t < n; t++)
+	    pthread_create(&tid[t], NULL, bench_thread, &w[t]);
+	for (t = 0; t < n; t++)
+	    pthread_join(tid[t], NULL);
+	secs = now() - start;
+	printf("%7d  %8.2f  %7.1f\n", n, n * rounds / secs / 1e6,
+	       secs * 1e9 / rounds);
+	if (n == num_threads)
+	    break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = -1;
+    size_t run = 16;
+    int c, timed = 0;
+
+    while ((c = getopt(argc, argv, "bt:n:l:")) != EOF) {
+	switch (c) {
+	case 'b':
+	    timed = 1;
+	    break;
+	case 't':
+	    num_threads = atoi(optarg);
+	    break;
+	case 'n':
+	    rounds = atol(optarg);
+	    break;
+	case 'l':
+	    run = atol(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-b] [-t threads] [-n rounds] [-l pages]\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS || run < 1 ||
+	run > SLICE_PAGES) {
+	fprintf(stderr, "%s: threads must be 1-%d and pages 1-%zu\n",
+		argv[0], MAX_THREADS, (size_t)SLICE_PAGES);
+	exit(1);
+    }
+    if (timed)
+	return bench(rounds > 0 ? rounds : 1000000, run);
+    return stress(rounds > 0 ? rounds : 100000);
+}
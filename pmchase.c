@@ -0,0 +1,111 @@
+/*
+ * pmchase.c - Microbenchmark of pagemap_is_mapped lookups
+ *
+ *	unix> pmchase [GiB ...]
+ *
+ * For each size (default 1 and 64 GiB) the pages of a region that
+ * large are marked mapped, and pagemap_is_mapped is timed on probes in
+ * three orders: sequential pages, uniformly random pages, and runs of
+ * 8 consecutive pages starting at random ones. Each probe's address
+ * depends on the previous result, so the lookups cannot overlap and
+ * the time per call is the latency of its chain of dependent loads.
+ * The best of five passes is printed, in ns per call.
+ *
+ * To compare pagemap layouts, build it against each pagemap.c, e.g.
+ *
+ *	unix> git show <commit>:pagemap.c > /tmp/pagemap_old.c
+ *	unix> gcc -O2 -I. -o pmchase_old pmchase.c /tmp/pagemap_old.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "pagemap.h"
+
+#define BASE ((uintptr_t)1 << 44)
+#define PROBES (1 << 22)      /* lookups per pass */
+#define PASSES 5
+#define RUN 8                 /* pages per run in the third order */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* best ns per lookup of the page indices in probe[] */
+static double chase(const uintptr_t *probe)
+{
+    double best = 1e30;
+    uintptr_t dep = 0;
+    int pass, i;
+
+    for (pass = 0; pass < PASSES; pass++) {
+	double start = now(), ns;
+
+	for (i = 0; i < PROBES; i++) {
+	    /* dep is always 0, but the compiler cannot know it */
+	    dep = !pagemap_is_mapped((char *)(BASE + ((probe[i] + dep) << LOG_APAGE_SIZE)));
+	}
+	ns = (now() - start) * 1e9 / PROBES;
+	if (ns < best)
+	    best = ns;
+    }
+    if (dep) {
+	fprintf(stderr, "pmchase: probe found an unmapped page\n");
+	exit(1);
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    static const long default_sizes[] = { 1, 64 };
+    uintptr_t *probe = malloc(PROBES * sizeof(uintptr_t));
+    int nsizes = argc > 1 ? argc - 1 : 2;
+    int k, i;
+
+    if (probe == NULL) {
+	fprintf(stderr, "pmchase: out of memory\n");
+	exit(1);
+    }
+    printf("ns per pagemap_is_mapped, best of %d\n", PASSES);
+    printf("size      sequential  random  runs of %d\n", RUN);
+    for (k = 0; k < nsizes; k++) {
+	long gib = argc > 1 ? atol(argv[k + 1]) : default_sizes[k];
+	uintptr_t pages = (uintptr_t)gib << (30 - LOG_APAGE_SIZE);
+	uint64_t seed = 88172645463325252ULL;
+	double seq, rnd, run;
+
+	if (gib < 1 || gib > 1024) {
+	    fprintf(stderr, "pmchase: sizes are 1-1024 GiB\n");
+	    exit(1);
+	}
+	pagemap_set_range((char *)BASE, pages << LOG_APAGE_SIZE, 1);
+
+	for (i = 0; i < PROBES; i++)
+	    probe[i] = i % pages;
+	seq = chase(probe);
+	for (i = 0; i < PROBES; i++)
+	    probe[i] = next_random(&seed) % pages;
+	rnd = chase(probe);
+	for (i = 0; i < PROBES; i++)
+	    probe[i] = i % RUN ? probe[i - 1] + 1 : next_random(&seed) % (pages - RUN);
+	run = chase(probe);
+
+	printf("%4ld GiB  %10.2f  %6.2f  %9.2f\n", gib, seq, rnd, run);
+	pagemap_set_range((char *)BASE, pages << LOG_APAGE_SIZE, 0);
+    }
+    free(probe);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# preload_bench.sh - Time real programs with mm.c as their malloc
+# (LD_PRELOAD=libmm.so) against the C library's malloc.
+#
+#	unix> make bench
+#	unix> ./preload_bench.sh [runs]
+#
+# Workloads: sort of a large shuffled file, gcc compiling mdriver.c
+# (the compiler proper and the assembler inherit LD_PRELOAD), and the
+# kvtoy key-value server. Each is timed runs times (default 3) under
+# each malloc and the fastest wall-clock time is kept. The outputs of
+# the two runs must match, or the workload is reported as broken.
+# MM_CONF is passed through, so tunables can be compared too.
+#
+RUNS=${1:-3}
+DIR=$(cd "$(dirname "$0")" && pwd)
+LIB=$DIR/libmm.so
+TMP=${TMPDIR:-/tmp}/preload_bench.$$
+
+if [ ! -f "$LIB" ] || [ ! -x "$DIR/kvtoy" ]; then
+    echo "$0: build libmm.so and kvtoy first (make bench)" >&2
+    exit 1
+fi
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# a million lines in a fixed random order
+awk 'BEGIN { srand(1); for (i = 0; i < 1000000; i++) print int(rand() * 1e9) }' \
+    > "$TMP/input.txt"
+
+wl_sort()  { sort -n "$TMP/input.txt" > "$1"; }
+wl_cc()    { ${CC:-gcc} -O2 -c "$DIR/mdriver.c" -o "$1"; }
+wl_kvtoy() { "$DIR/kvtoy" 1000000 4 > "$1"; }
+
+# best wall-clock seconds of RUNS runs of workload $1 with LD_PRELOAD=$3;
+# the output goes to $TMP/out.$2
+best() {
+    b=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+	t0=$(date +%s.%N)
+	(LD_PRELOAD=$3; export LD_PRELOAD; "wl_$1" "$TMP/out.$2") || return 1
+	t1=$(date +%s.%N)
+	b=$(echo "$t0 $t1 $b" | awk '{ t = $2 - $1; print ($3 == "" || t < $3) ? t : $3 }')
+	i=$((i + 1))
+    done
+    echo "$b"
+}
+
+printf "%-8s %10s %10s %12s\n" workload "glibc s" "libmm s" "libmm/glibc"
+status=0
+for w in sort cc kvtoy; do
+    if ! g=$(best $w glibc "") || ! m=$(best $w libmm "$LIB"); then
+	printf "%-8s failed\n" $w
+	status=1
+    elif ! cmp -s "$TMP/out.glibc" "$TMP/out.libmm"; then
+	printf "%-8s output differs under libmm.so\n" $w
+	status=1
+    else
+	printf "%-8s %10.3f %10.3f %12.2f\n" $w "$g" "$m" \
+	    "$(echo "$g $m" | awk '{ print ($1 > 0) ? $2 / $1 : 0 }')"
+    fi
+done
+exit $status
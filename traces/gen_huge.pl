@@ -0,0 +1,39 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "huge-bal.rep";
+$blk_size = 100 * 1000 * 1000;  # 100 MB payloads
+$small_size = 4000;
+$num_iters = 8;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Calculate misc parameters
+$suggested_heap_size = 2*$blk_size + $small_size*$num_iters + 100;
+$num_blocks = 2*$num_iters;
+$num_ops = 4*$num_iters;
+
+print OUTFILE "$suggested_heap_size\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+
+# At most two huge blocks are live at once, each next to a small one
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $big = 2*$i;
+    $small = 2*$i + 1;
+    print OUTFILE "a $big $blk_size\n";
+    print OUTFILE "a $small $small_size\n";
+    if ($i > 0) {
+	$prev = 2*($i - 1);
+	print OUTFILE "f $prev\n";
+    }
+}
+print OUTFILE "f ", 2*($num_iters - 1), "\n";
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $small = 2*$i + 1;
+    print OUTFILE "f $small\n";
+}
+
+close OUTFILE;
@@ -0,0 +1,46 @@
+#!/usr/bin/perl
+#
+# rep2bin.pl - convert text .rep traces to the binary format that
+# mdriver's read_trace recognizes by its "MMTB" magic number
+#
+# usage: rep2bin.pl file.rep ...    (writes file.bin next to each)
+#
+# After the magic come sugg_heapsize, num_ids, num_ops and weight, then
+# one record per request: (zigzag(index delta) << 2 | type), with type
+# 0 for a, 1 for f and 2 for r, followed by the size for a and r. All
+# numbers are BER compressed integers (pack "w").
+
+%types = ('a' => 0, 'f' => 1, 'r' => 2);
+
+foreach $in (@ARGV) {
+    ($out = $in) =~ s/(\.rep)?$/.bin/;
+    open INFILE, "<$in" or die "Cannot open $in\n";
+    open OUTFILE, ">$out" or die "Cannot create $out\n";
+    binmode OUTFILE;
+
+    # header: four numbers, one per line
+    @header = ();
+    while (@header < 4 && defined($line = <INFILE>)) {
+	push @header, split(' ', $line);
+    }
+    die "Truncated header in $in\n" if @header < 4;
+    print OUTFILE "MMTB", pack("w4", @header[0..3]);
+
+    $prev = 0;
+    $n = 0;
+    while ($line = <INFILE>) {
+	($op, $index, $size) = split(' ', $line);
+	next unless defined $op;
+	$type = $types{substr($op, 0, 1)};
+	die "Bogus type character ($op) in $in\n" unless defined $type;
+	$delta = $index - $prev;
+	$zigzag = $delta >= 0 ? 2*$delta : -2*$delta - 1;
+	$prev = $index;
+	print OUTFILE pack("w", $zigzag * 4 + $type);
+	print OUTFILE pack("w", $size) if $type != 1;
+	$n++;
+    }
+    die "$in: header says $header[2] requests, found $n\n" if $n != $header[2];
+    close INFILE;
+    close OUTFILE;
+}